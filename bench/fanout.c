@@ -0,0 +1,238 @@
+/* Client fan-out benchmark for muxirc
+ *
+ * Sends the same lines to many clients the way send_all_buffer does, first
+ * with the event-loop thread writing to every client itself and then with
+ * the writes handed to 1, 2, ... workers, and reports how many client lines
+ * per second get written. The clients are socketpairs whose other ends are
+ * drained by as many sink threads as there are workers (at least one), so
+ * the sinks' reads compete for the same cores. Each configuration runs in
+ * its own process, as workers run until their process exits.
+ * Usage: bench/fanout [clients [lines [maxworkers]]]
+ *
+ * James Stanley 2012
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+
+#include "../src/event.h"
+#include "../src/buffer.h"
+#include "../src/socket.h"
+#include "../src/worker.h"
+
+/* how far (in bytes per client) the sinks may fall behind before the
+ * sender waits for them, so that memory use stays bounded
+ */
+#define WINDOW 65536
+
+/* lines are sent this many at a time between runs of the event loop, as if
+ * they had all come from one read from the server
+ */
+#define BURST 32
+
+/* the line that is sent to every client */
+static const char line[] = ":nick!~user@host.example.com PRIVMSG #channel "
+    ":this is a fairly ordinary line of chat text\r\n";
+
+static int nclients;
+static long nlines;
+
+static int *sinkfd;
+static long received;
+
+/* return the current time in seconds */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* read from every one of the sink's sockets until they are all closed */
+static void *run_sink(void *data) {
+    long first = ((long *)data)[0], end = ((long *)data)[1];
+    struct epoll_event e[64];
+    static __thread char buf[65536];
+    int epfd = epoll_create1(0);
+    long open = end - first;
+    long i;
+
+    for(i = first; i < end; i++) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = sinkfd[i];
+        epoll_ctl(epfd, EPOLL_CTL_ADD, sinkfd[i], &ev);
+    }
+
+    while(open > 0) {
+        int n = epoll_wait(epfd, e, 64, -1);
+
+        for(i = 0; i < n; i++) {
+            ssize_t r = read(e[i].data.fd, buf, sizeof(buf));
+
+            if(r > 0) {
+                __atomic_add_fetch(&received, r, __ATOMIC_RELAXED);
+            } else if(r == 0) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, e[i].data.fd, NULL);
+                open--;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* a worker has given up on a client; nothing should go wrong here */
+static void handle_job(Job *j) {
+    if(j->type == JOB_ERROR)
+        fprintf(stderr, "a client failed\n");
+}
+
+/* write what is queued for a client that the event-loop thread handles */
+static void handle_client_event(void *data, int events) {
+    if(events & EV_WRITE)
+        flush_socket(data);
+}
+
+/* send nlines lines to every client with nworkers workers, and return how
+ * many seconds that took
+ */
+static double run(int nworkers) {
+    size_t len = strlen(line);
+    int nsinks = nworkers ? nworkers : 1;
+    Socket **sock = malloc(nclients * sizeof(Socket *));
+    pthread_t *sink = malloc(nsinks * sizeof(pthread_t));
+    long (*slice)[2] = malloc(nsinks * sizeof(*slice));
+    Workers workers;
+    long sent = 0, i;
+    int c;
+
+    if(init_events() != 0)
+        exit(1);
+    if(nworkers && start_workers(&workers, nworkers, handle_job) != 0)
+        exit(1);
+
+    sinkfd = malloc(nclients * sizeof(int));
+    for(c = 0; c < nclients; c++) {
+        int fds[2];
+
+        if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+            perror("socketpair");
+            exit(1);
+        }
+        fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+        sock[c] = new_socket();
+        sock[c]->fd = fds[0];
+        sinkfd[c] = fds[1];
+
+        if(nworkers) {
+            init_event(&sock[c]->ev, handle_client_event, sock[c]);
+            sock[c]->peer = add_peer(&workers, sock[c], NULL);
+        } else if(add_event(&sock[c]->ev, fds[0], EV_WRITE,
+                    handle_client_event, sock[c]) != 0) {
+            exit(1);
+        }
+    }
+
+    for(i = 0; i < nsinks; i++) {
+        slice[i][0] = (long)nclients * i / nsinks;
+        slice[i][1] = (long)nclients * (i + 1) / nsinks;
+        pthread_create(sink + i, NULL, run_sink, slice[i]);
+    }
+
+    double start = now();
+
+    for(i = 0; i < nlines; i++) {
+        Buffer *buf = new_buffer(len);
+        memcpy(buf->data, line, len);
+        buf->len = len;
+
+        for(c = 0; c < nclients; c++)
+            send_socket_buffer(sock[c], buf);
+        free_buffer(buf);
+        sent += len * nclients;
+
+        if((i + 1) % BURST)
+            continue;
+
+        /* let the writes (or the workers' wakeups) happen, and don't get
+         * too far ahead of the sinks
+         */
+        wait_events(0);
+        while(sent - __atomic_load_n(&received, __ATOMIC_RELAXED)
+                > (long)WINDOW * nclients)
+            wait_events(1);
+    }
+
+    while(__atomic_load_n(&received, __ATOMIC_RELAXED) < sent)
+        wait_events(1);
+
+    double t = now() - start;
+
+    /* everything has been read, so the sinks can be stopped by closing the
+     * clients' ends, even those that belong to a worker
+     */
+    for(c = 0; c < nclients; c++)
+        close(sock[c]->fd);
+    for(i = 0; i < nsinks; i++)
+        pthread_join(sink[i], NULL);
+
+    return t;
+}
+
+int main(int argc, char **argv) {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int maxworkers;
+    double base = 0;
+    int pipefd[2];
+    int w;
+
+    nclients = argc > 1 ? atoi(argv[1]) : 1000;
+    nlines = argc > 2 ? atol(argv[2]) : 2000;
+    maxworkers = argc > 3 ? atoi(argv[3]) : (ncpus > 1 ? ncpus : 2);
+
+    printf("%d clients, %ld lines each, %ld cpus\n", nclients, nlines, ncpus);
+
+    for(w = 0; w <= maxworkers; w++) {
+        pid_t pid;
+        double t;
+
+        /* the run's time comes back through a pipe */
+        if(pipe(pipefd) == -1) {
+            perror("pipe");
+            return 1;
+        }
+
+        fflush(stdout);
+        if((pid = fork()) == 0) {
+            t = run(w);
+            exit(write(pipefd[1], &t, sizeof(t)) != sizeof(t));
+        }
+
+        close(pipefd[1]);
+        waitpid(pid, NULL, 0);
+        if(read(pipefd[0], &t, sizeof(t)) != sizeof(t)) {
+            fprintf(stderr, "run with %d workers failed\n", w);
+            return 1;
+        }
+        close(pipefd[0]);
+
+        if(w == 0)
+            base = t;
+        printf("%2d workers: %10.0f client lines/s  %8.1f MB/s  (%.2fx)\n",
+                w, nlines * nclients / t,
+                nlines * nclients * strlen(line) / t / 1e6,
+                base / t);
+    }
+
+    return 0;
+}
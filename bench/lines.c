@@ -0,0 +1,191 @@
+/* Line splitting benchmark for muxirc
+ *
+ * Compares the strpbrk()-based line splitting that handle_messages used to
+ * do with split_lines(), feeding both the same upstream data in read-sized
+ * chunks. Usage: bench/lines [capture-file]
+ * Without a capture file, a synthetic burst resembling a join to several
+ * large channels (NAMES replies, JOINs, QUITs and PRIVMSGs) is used.
+ *
+ * James Stanley 2012
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/str.h"
+
+#define READ_SIZE 4096
+#define BUF_SIZE 8192
+#define TARGET_BYTES (256 * 1024 * 1024)
+
+static char *data;
+static size_t datalen;
+
+/* return the current time in seconds */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* append a line of synthetic upstream traffic to data */
+static void add_line(size_t *size, const char *fmt, int n) {
+    char line[1024];
+    int len = snprintf(line, sizeof(line), fmt, n, n, n);
+
+    if(datalen + len > *size) {
+        *size = (*size + len) * 2;
+        data = realloc(data, *size);
+    }
+
+    memcpy(data + datalen, line, len);
+    datalen += len;
+}
+
+/* build a synthetic burst of upstream traffic */
+static void make_burst(void) {
+    size_t size = 0;
+    char names[1024];
+    int i, j;
+
+    /* a NAMES reply line is as long as the server will make it */
+    strcpy(names, ":irc.example.net 353 muxirc = #bigchannel :");
+    for(j = 0; strlen(names) < 480; j++)
+        sprintf(names + strlen(names), "%snick_%d ", j % 7 ? "" : "@", j);
+    strcat(names, "\r\n");
+
+    for(i = 0; i < 20000; i++) {
+        switch(i % 8) {
+        case 0: case 1: case 2:
+            add_line(&size, names, i);
+            break;
+        case 3:
+            add_line(&size, ":nick%d!~user%d@host-%d.example.com JOIN "
+                    "#bigchannel\r\n", i);
+            break;
+        case 4:
+            add_line(&size, ":nick%d!~user%d@host-%d.example.com QUIT "
+                    ":*.net *.split\r\n", i);
+            break;
+        default:
+            add_line(&size, ":nick%d!~user%d@host-%d.example.com PRIVMSG "
+                    "#bigchannel :this is a fairly ordinary line of chat "
+                    "text\r\n", i);
+            break;
+        }
+    }
+}
+
+/* read the capture file into data */
+static void read_capture(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    size_t size = 0, r;
+
+    if(!fp) {
+        perror(path);
+        exit(1);
+    }
+
+    do {
+        if(datalen == size)
+            data = realloc(data, size = size * 2 + 65536);
+        r = fread(data + datalen, 1, size - datalen, fp);
+        datalen += r;
+    } while(r > 0);
+
+    fclose(fp);
+}
+
+/* split lines the way handle_messages used to: strpbrk for the endline,
+ * strspn past it, and memmove the left-over data to the start of the buffer
+ */
+static long old_split(char *buf, size_t *bytes) {
+    char *p, *str = buf;
+    long n = 0;
+
+    while((p = strpbrk(str, "\r\n"))) {
+        char c = *p;
+        *p = '\0';
+        n++;
+        *p = c;
+        str = p + strspn(p, "\r\n");
+    }
+
+    *bytes -= str - buf;
+    memmove(buf, str, *bytes + 1);
+
+    return n;
+}
+
+/* split lines with split_lines */
+static long new_split(char *buf, size_t *bytes) {
+    LineSpan line[64];
+    size_t off = 0, used;
+    long total = 0;
+    int n;
+
+    do {
+        n = split_lines(buf + off, *bytes - off, line, 64, &used);
+        total += n;
+        off += used;
+    } while(n == 64);
+
+    *bytes -= off;
+    memmove(buf, buf + off, *bytes + 1);
+
+    return total;
+}
+
+/* feed data through split in READ_SIZE chunks until TARGET_BYTES have been
+ * processed, and report the throughput
+ */
+static void run(const char *name, long (*split)(char *, size_t *)) {
+    static char buf[BUF_SIZE + 1];
+    size_t bytes = 0, done = 0, off = 0;
+    long lines = 0;
+    double start = now();
+
+    while(done < TARGET_BYTES) {
+        size_t r = READ_SIZE;
+        if(r > datalen - off)
+            r = datalen - off;
+        if(r > BUF_SIZE - bytes)
+            r = BUF_SIZE - bytes;
+
+        memcpy(buf + bytes, data + off, r);
+        bytes += r;
+        buf[bytes] = '\0';
+
+        lines += split(buf, &bytes);
+
+        done += r;
+        off += r;
+        if(off == datalen)
+            off = 0;
+    }
+
+    double t = now() - start;
+    printf("%-12s %8.1f MB/s  %10.0f lines/s  (%ld lines)\n", name,
+            done / t / 1e6, lines / t, lines);
+}
+
+int main(int argc, char **argv) {
+    if(argc > 1)
+        read_capture(argv[1]);
+    else
+        make_burst();
+
+    if(!datalen) {
+        fprintf(stderr, "no data\n");
+        return 1;
+    }
+
+    printf("%zu bytes of input, %d-byte reads\n", datalen, READ_SIZE);
+
+    run("strpbrk", old_split);
+    run("split_lines", new_split);
+
+    return 0;
+}
@@ -0,0 +1,250 @@
+/* Message serializing benchmark for muxirc
+ *
+ * Compares the way messages used to be sent to a socket (stringified with
+ * strappend into a malloc()ed line by strmessage, which send_socket_string
+ * then copied into the output queue, with send_socket_messagev building a
+ * Message first) with writing them straight into the output queue. The
+ * socket's queue is emptied every BATCH messages, as a batch of events
+ * would. Usage: bench/serialize [messages]
+ *
+ * James Stanley 2012
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "../src/event.h"
+#include "../src/buffer.h"
+#include "../src/socket.h"
+#include "../src/message.h"
+#include "../src/str.h"
+
+/* messages sent between runs of the event loop */
+#define BATCH 64
+
+static long nmessages;
+
+/* return the current time in seconds */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* stringify m into line the way write_message used to, with strappend */
+static size_t old_write_message(const Message *m, char *line) {
+    char command[16];
+    size_t taglen = 0;
+
+    if(m->tags) {
+        taglen = strlen(m->tags) + 2;
+        line[0] = '@';
+        memcpy(line + 1, m->tags, taglen - 2);
+        line[taglen - 1] = ' ';
+        line += taglen;
+    }
+
+    char *endptr = line;
+
+    if(m->nick) {
+        strappend(line, &endptr, 511, ":");
+        strappend(line, &endptr, 511, m->nick);
+        if(m->user) {
+            strappend(line, &endptr, 511, "!");
+            strappend(line, &endptr, 511, m->user);
+        }
+        if(m->host) {
+            strappend(line, &endptr, 511, "@");
+            strappend(line, &endptr, 511, m->host);
+        }
+
+        strappend(line, &endptr, 511, " ");
+    }
+
+    if(m->command < FIRST_CMD || m->command >= NCOMMANDS) {
+        if(m->command == CMD_INVALID) {
+            strappend(line, &endptr, 511, m->param[0]);
+        } else {
+            snprintf(command, 8, "%03d", m->command);
+            strappend(line, &endptr, 511, command);
+        }
+    } else {
+        strappend(line, &endptr, 511, command_string[m->command - FIRST_CMD]);
+    }
+
+    int i;
+    for(i = (m->command == CMD_INVALID); i < m->nparams; i++) {
+        strappend(line, &endptr, 511, " ");
+        if(i == m->nparams-1 && (m->param[i][0] == ':'
+                    || strchr(m->param[i], ' ')))
+            strappend(line, &endptr, 511, ":");
+        strappend(line, &endptr, 511, m->param[i]);
+    }
+
+    strappend(line, &endptr, 513, "\r\n");
+
+    return taglen + (endptr - line);
+}
+
+/* send m the way send_socket_message used to, through strmessage */
+static int old_send_message(Socket *sock, const Message *m) {
+    char *line = malloc(message_size(m));
+    size_t len = old_write_message(m, line);
+    int r = send_socket_string(sock, line, len);
+
+    free(line);
+    return r;
+}
+
+/* send a message the way send_socket_messagev used to, by building a
+ * Message and sending that
+ */
+static int old_send_messagev(Socket *sock, const char *nick, const char *user,
+        const char *host, int command, ...) {
+    va_list argp;
+    Message m;
+    const char *s;
+
+    memset(&m, 0, sizeof(Message));
+    m.nick = nick;
+    m.user = user;
+    m.host = host;
+    m.command = command;
+
+    va_start(argp, command);
+    while((s = va_arg(argp, const char *)))
+        add_message_param(&m, s);
+    va_end(argp);
+
+    return old_send_message(sock, &m);
+}
+
+/* the messages sent by the Message-based functions: chat, a JOIN, and the
+ * kind of reply that is sent to clients as they attach
+ */
+static Message msg[4];
+
+static void make_messages(void) {
+    static char names[512];
+    int j;
+
+    for(j = 0; strlen(names) < 400; j++)
+        sprintf(names + strlen(names), "%snick_%d ", j % 7 ? "" : "@", j);
+
+    msg[0].nick = "nick";
+    msg[0].user = "~user";
+    msg[0].host = "host.example.com";
+    msg[0].command = CMD_PRIVMSG;
+    msg[0].param[0] = "#channel";
+    msg[0].param[1] = "this is a fairly ordinary line of chat text";
+    msg[0].nparams = 2;
+
+    msg[1].nick = "nick";
+    msg[1].user = "~user";
+    msg[1].host = "host.example.com";
+    msg[1].command = CMD_JOIN;
+    msg[1].param[0] = "#channel";
+    msg[1].nparams = 1;
+
+    msg[2].nick = "irc.example.net";
+    msg[2].command = RPL_NAMREPLY;
+    msg[2].param[0] = "muxirc";
+    msg[2].param[1] = "=";
+    msg[2].param[2] = "#channel";
+    msg[2].param[3] = names;
+    msg[2].nparams = 4;
+
+    msg[3].nick = "irc.example.net";
+    msg[3].command = RPL_TOPIC;
+    msg[3].param[0] = "muxirc";
+    msg[3].param[1] = "#channel";
+    msg[3].param[2] = "the topic of the channel";
+    msg[3].nparams = 3;
+}
+
+/* send the ith message in each of the four ways being compared */
+static int send_old(Socket *sock, long i) {
+    return old_send_message(sock, msg + i % 4);
+}
+
+static int send_new(Socket *sock, long i) {
+    return send_socket_message(sock, msg + i % 4);
+}
+
+static int send_oldv(Socket *sock, long i) {
+    if(i % 2)
+        return old_send_messagev(sock, "nick", "~user", "host.example.com",
+                CMD_PRIVMSG, "#channel",
+                "this is a fairly ordinary line of chat text", NULL);
+    return old_send_messagev(sock, "irc.example.net", NULL, NULL, RPL_TOPIC,
+            "muxirc", "#channel", "the topic of the channel", NULL);
+}
+
+static int send_newv(Socket *sock, long i) {
+    if(i % 2)
+        return send_socket_messagev(sock, "nick", "~user", "host.example.com",
+                CMD_PRIVMSG, "#channel",
+                "this is a fairly ordinary line of chat text", NULL);
+    return send_socket_messagev(sock, "irc.example.net", NULL, NULL,
+            RPL_TOPIC, "muxirc", "#channel", "the topic of the channel",
+            NULL);
+}
+
+/* stand in for writing the queue out once the batch is done */
+static void handle_sock_event(void *data, int events) {
+    Socket *sock = data;
+    free_queue(&sock->outq);
+}
+
+/* send nmessages messages to sock with send, report the throughput
+ * (relative to base, if that is not 0), and return the time taken
+ */
+static double run(const char *name, Socket *sock,
+        int (*send)(Socket *, long), double base) {
+    long i;
+    double start = now();
+
+    for(i = 0; i < nmessages; i++) {
+        send(sock, i);
+        if((i + 1) % BATCH == 0)
+            wait_events(0);
+    }
+    wait_events(0);
+
+    double t = now() - start;
+    printf("%-24s %10.0f messages/s", name, nmessages / t);
+    if(base)
+        printf("  (%.2fx)", base / t);
+    printf("\n");
+
+    return t;
+}
+
+int main(int argc, char **argv) {
+    Socket *sock;
+    double base;
+
+    nmessages = argc > 1 ? atol(argv[1]) : 5000000;
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    if(init_events() != 0)
+        return 1;
+
+    make_messages();
+
+    sock = new_socket();
+    init_event(&sock->ev, handle_sock_event, sock);
+
+    printf("%ld messages, sent %d at a time\n", nmessages, BATCH);
+
+    base = run("old send_socket_message", sock, send_old, 0);
+    run("send_socket_message", sock, send_new, base);
+    base = run("old send_socket_messagev", sock, send_oldv, 0);
+    run("send_socket_messagev", sock, send_newv, base);
+
+    return 0;
+}
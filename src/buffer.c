@@ -0,0 +1,201 @@
+/* Buffer handling for muxirc
+ *
+ * James Stanley 2012
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#include "buffer.h"
+
+/* size of the buffers that small writes are gathered into */
+#define QUEUE_CHUNK 4096
+
+/* maximum number of buffers handed to a single writev() */
+#define MAX_IOV 64
+
+/* nodes that have been freed but not given back to the allocator, as
+ * clients tend to queue and flush a handful of them on every wakeup; each
+ * event-loop thread keeps its own
+ */
+static __thread QueueNode *free_nodes;
+static __thread int nfree_nodes;
+
+#define MAX_FREE_NODES 1024
+
+/* allocate a buffer with room for size bytes, holding a single reference */
+Buffer *new_buffer(size_t size) {
+    Buffer *buf = malloc(sizeof(Buffer) + size);
+    buf->refs = 1;
+    buf->len = 0;
+    buf->size = size;
+    return buf;
+}
+
+/* take another reference to the buffer and return it; a buffer with more
+ * than one reference must not be modified; references may be held by
+ * different threads, so the count is updated atomically
+ */
+Buffer *ref_buffer(Buffer *buf) {
+    __atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+    return buf;
+}
+
+/* drop a reference to the buffer, freeing it if it was the last one */
+void free_buffer(Buffer *buf) {
+    if(__atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(buf);
+}
+
+/* return a node from the free list, or a new one if the list is empty */
+static QueueNode *new_node(void) {
+    QueueNode *n = free_nodes;
+
+    if(n) {
+        free_nodes = n->next;
+        nfree_nodes--;
+    } else {
+        n = malloc(sizeof(QueueNode));
+    }
+
+    memset(n, 0, sizeof(QueueNode));
+    return n;
+}
+
+/* put the node back on the free list, or free it if the list is full */
+static void free_node(QueueNode *n) {
+    if(nfree_nodes < MAX_FREE_NODES) {
+        n->next = free_nodes;
+        free_nodes = n;
+        nfree_nodes++;
+    } else {
+        free(n);
+    }
+}
+
+/* add a node for buf to the end of the queue */
+static QueueNode *queue_push(Queue *q, Buffer *buf) {
+    QueueNode *n = new_node();
+    n->buf = buf;
+
+    if(q->tail)
+        q->tail->next = n;
+    else
+        q->head = n;
+    q->tail = n;
+    q->nnodes++;
+
+    return n;
+}
+
+/* remove the first node from the queue, dropping its buffer reference */
+static void queue_pop(Queue *q) {
+    QueueNode *n = q->head;
+
+    q->head = n->next;
+    if(!q->head)
+        q->tail = NULL;
+    q->nnodes--;
+
+    free_buffer(n->buf);
+    free_node(n);
+}
+
+/* return room for len bytes at the end of the queue, in the last buffer if
+ * it is not shared and there is room, and in a new one otherwise, so that
+ * something can be written straight into the queue; nothing is queued until
+ * queue_commit is called
+ */
+char *queue_reserve(Queue *q, size_t len) {
+    QueueNode *n = q->tail;
+
+    if(!n || __atomic_load_n(&n->buf->refs, __ATOMIC_ACQUIRE) != 1
+            || n->buf->size - n->buf->len < len)
+        n = queue_push(q, new_buffer(len > QUEUE_CHUNK ? len : QUEUE_CHUNK));
+
+    return n->buf->data + n->buf->len;
+}
+
+/* queue the first len bytes (which must not be 0) of the room that
+ * queue_reserve last returned
+ */
+void queue_commit(Queue *q, size_t len) {
+    q->tail->buf->len += len;
+    q->bytes += len;
+}
+
+/* append len bytes of str to the end of the queue, copying them into the
+ * last buffer if it is not shared and there is room, and into a new one
+ * otherwise
+ */
+void queue_append(Queue *q, const char *str, size_t len) {
+    memcpy(queue_reserve(q, len), str, len);
+    queue_commit(q, len);
+}
+
+/* append a reference to the whole of buf to the end of the queue without
+ * copying it; the reference is dropped once it has been written
+ */
+void queue_buffer(Queue *q, Buffer *buf) {
+    queue_push(q, ref_buffer(buf));
+    q->bytes += buf->len;
+}
+
+/* write as much of the queue to fd as it will take without blocking,
+ * freeing whatever has been written; return 0 if the queue is now empty, 1 if
+ * there is still data waiting for fd to become writable, and -1 on error
+ */
+int queue_flush(Queue *q, int fd) {
+    struct iovec iov[MAX_IOV];
+
+    while(q->head) {
+        QueueNode *n;
+        ssize_t r;
+        int i = 0;
+
+        for(n = q->head; n && i < MAX_IOV; n = n->next, i++) {
+            iov[i].iov_base = n->buf->data + n->off;
+            iov[i].iov_len = n->buf->len - n->off;
+        }
+
+        /* keep trying while EINTR */
+        while((r = writev(fd, iov, i)) < 0)
+            if(errno != EINTR)
+                break;
+
+        if(r < 0)
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+
+        q->bytes -= r;
+
+        /* free the buffers that were completely written, and remember how
+         * much of the first remaining one was written
+         */
+        while(r > 0) {
+            size_t left = q->head->buf->len - q->head->off;
+
+            if(r < left) {
+                q->head->off += r;
+                break;
+            }
+
+            r -= left;
+            queue_pop(q);
+        }
+
+        /* a short write means the socket buffer is full */
+        if(q->head && q->head->off)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* throw away everything in the queue */
+void free_queue(Queue *q) {
+    while(q->head)
+        queue_pop(q);
+    q->bytes = 0;
+}
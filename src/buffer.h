@@ -0,0 +1,38 @@
+/* Buffer handling for muxirc
+ *
+ * James Stanley 2012
+ */
+
+#ifndef BUFFER_H_INC
+#define BUFFER_H_INC
+
+typedef struct Buffer {
+    int refs;
+    size_t len;
+    size_t size;
+    char data[];
+} Buffer;
+
+typedef struct QueueNode {
+    Buffer *buf;
+    size_t off;
+    struct QueueNode *next;
+} QueueNode;
+
+typedef struct Queue {
+    QueueNode *head, *tail;
+    size_t bytes;
+    int nnodes;
+} Queue;
+
+Buffer *new_buffer(size_t size);
+Buffer *ref_buffer(Buffer *buf);
+void free_buffer(Buffer *buf);
+char *queue_reserve(Queue *q, size_t len);
+void queue_commit(Queue *q, size_t len);
+void queue_append(Queue *q, const char *str, size_t len);
+void queue_buffer(Queue *q, Buffer *buf);
+int queue_flush(Queue *q, int fd);
+void free_queue(Queue *q);
+
+#endif
@@ -8,113 +8,681 @@
 #include <stdlib.h>
 #include <stdarg.h>
 
+#include "event.h"
+#include "buffer.h"
+#include "table.h"
+#include "name.h"
+#include "slab.h"
 #include "socket.h"
+#include "worker.h"
+#include "connect.h"
+#include "pool.h"
+#include "sched.h"
 #include "message.h"
 #include "client.h"
+#include "config.h"
 #include "server.h"
 #include "channel.h"
+#include "request.h"
+#include "str.h"
+
+/* return the nick of the member, for the member tables */
+static const char *member_nick(const void *member) {
+    return ((const Member *)member)->nick->str;
+}
+
+/* return the member of the table with the nick, or NULL if there is none */
+static Member *find_member(const Table *members, const Name *nick) {
+    return table_lookup_hash(members, nick->str, nick->hash);
+}
+
+/* free the member and its reference to its nick */
+static void free_member(Server *s, Member *member) {
+    free_name(&(s->names), member->nick);
+    free(member);
+}
+
+/* put the channel at the end of the server's channel order, making room for
+ * it if need be
+ */
+static void order_channel(Server *s, Channel *chan) {
+    if(s->nordered == s->orderroom) {
+        int room = s->orderroom ? 2 * s->orderroom : SLAB_BLOCK;
+        int *order = realloc(s->channel_order, room * sizeof(int));
+        if(!order) {
+            perror("realloc");
+            exit(1);
+        }
+        s->channel_order = order;
+        s->orderroom = room;
+    }
+
+    chan->order = s->nordered;
+    s->channel_order[s->nordered++] = chan->handle;
+}
+
+/* close up the gaps that freed channels have left in the channel order */
+static void compact_order(Server *s) {
+    int i, n = 0;
+
+    for(i = 0; i < s->nordered; i++) {
+        int h = s->channel_order[i];
+        if(h == -1)
+            continue;
+
+        Channel *chan = slab_item(&(s->channel_slab), h);
+        chan->order = n;
+        s->channel_order[n++] = h;
+    }
+
+    s->nordered = n;
+}
+
+/* allocate a new empty channel for the server */
+Channel *new_channel(Server *s) {
+    int h = slab_alloc(&(s->channel_slab));
+    Channel *chan = slab_item(&(s->channel_slab), h);
+
+    chan->handle = h;
+    chan->symbol = '=';
+    init_table(&(chan->members), member_nick, CASEMAP_RFC1459);
+    init_table(&(chan->oldmembers), member_nick, CASEMAP_RFC1459);
+
+    /* slots are reused, so the order channels were made in is kept apart */
+    order_channel(s, chan);
 
-/* allocate a new empty channel */
-Channel *new_channel(void) {
-    Channel *chan = malloc(sizeof(Channel));
-    memset(chan, 0, sizeof(Channel));
     return chan;
 }
 
-/* remove the given channel from it's list (if any) and free it */
-void free_channel(Channel *chan, Channel **list) {
+/* return the name of the channel, for the channel table */
+const char *channel_name(const void *chan) {
+    return ((const Channel *)chan)->name;
+}
+
+/* forget everybody in the channel */
+void clear_members(Server *s, Channel *chan) {
+    Member *member;
+    size_t i = 0;
+
+    while((member = table_next(&(chan->members), &i)))
+        free_member(s, member);
+
+    free_table(&(chan->members));
+}
+
+/* free the members we knew about before rejoining the channel */
+static void clear_old_members(Server *s, Channel *chan) {
+    Member *member;
+    size_t i = 0;
+
+    while((member = table_next(&(chan->oldmembers), &i)))
+        free_member(s, member);
+
+    free_table(&(chan->oldmembers));
+    free(chan->oldtopic);
+    chan->oldtopic = NULL;
+}
+
+/* free the channel */
+void free_channel(Server *s, Channel *chan) {
     free(chan->name);
+    free(chan->key);
     free(chan->topic);
+    free(chan->topic_setter);
+    clear_members(s, chan);
+    clear_old_members(s, chan);
 
-    if(chan->prev)
-        chan->prev->next = chan->next;
-    if(chan->next)
-        chan->next->prev = chan->prev;
+    /* the gap is left until half of the order is gaps, so that parting
+     * many channels doesn't move the rest each time
+     */
+    s->channel_order[chan->order] = -1;
+    slab_free(&(s->channel_slab), chan->handle);
+    if(2 * s->channel_slab.count < s->nordered)
+        compact_order(s);
+}
 
-    if(list && *list == chan)
-        *list = chan->next;
+/* return the next of the server's channels in the order they were made in,
+ * starting from position *h and updating it to continue from there next
+ * time, or NULL if there are no more; start with *h = 0, and don't free
+ * channels until done
+ */
+Channel *next_channel(Server *s, int *h) {
+    while(*h < s->nordered) {
+        int handle = s->channel_order[(*h)++];
+        if(handle != -1)
+            return slab_item(&(s->channel_slab), handle);
+    }
 
-    free(chan);
+    return NULL;
 }
 
-/* prepend a client to the list pointed to by list, point list to c,
- * and return the new head
+/* return the channel with the given name (compared according to the
+ * server's casemapping), or NULL if there is none
  */
-Channel *prepend_channel(Channel *chan, Channel **list) {
-    if(*list) {
-        if((*list)->prev)
-            (*list)->prev->next = chan;
-        chan->prev = (*list)->prev;
-        chan->next = *list;
-        (*list)->prev = chan;
-    } else {
-        chan->prev = NULL;
-        chan->next = NULL;
-    }
+Channel *lookup_channel(Server *s, const char *channel) {
+    return table_lookup(&(s->channels), channel);
+}
 
-    *list = chan;
+/* make a new channel with the given name and add it to the server's channel
+ * table
+ */
+static Channel *add_channel(Server *s, const char *channel) {
+    Channel *chan = new_channel(s);
+    chan->name = strdup(channel);
+    chan->members.casemap = s->casemapping;
+    chan->oldmembers.casemap = s->casemapping;
+    table_insert(&(s->channels), chan);
+    return chan;
+}
 
-    return *list;
+/* remove the channel from the server and free it */
+static void remove_channel(Server *s, Channel *chan) {
+    table_remove(&(s->channels), chan->name);
+    free_channel(s, chan);
 }
 
-/* return the channel from the list with the given name, or NULL if there is
- * none
+/* send the JOINs that are waiting to the server as a single line (channels
+ * with keys have to come first, as keys are given in the same order)
  */
-Channel *lookup_channel(Channel *list, const char *channel) {
-    Channel *chan;
+static void send_joins(Server *s) {
+    char channels[1024];
 
-    for(chan = list;
-        chan && strcasecmp(chan->name, channel) != 0;
-        chan = chan->next);
+    if(!*s->keyed && !*s->joins)
+        return;
 
-    return chan;
+    snprintf(channels, sizeof(channels), "%s%s%s", s->keyed,
+            *s->keyed && *s->joins ? "," : "", s->joins);
+
+    send_server_messagev(s, LANE_INTERACTIVE, CMD_JOIN, channels,
+            *s->keys ? s->keys : NULL, NULL);
+
+    /* the joins may be for several clients, so errors that come back go to
+     * all of them rather than to whoever sent something last
+     */
+    s->last_client = NULL;
+
+    *s->keyed = *s->keys = *s->joins = '\0';
 }
 
-/* attempt to join the channel */
-void join_channel(Server *s, const char *channel) {
-    Channel *chan = lookup_channel(s->channel_list, channel);
+/* send the PARTs that are waiting to the server as a single line */
+static void send_parts(Server *s) {
+    if(!*s->parts)
+        return;
+
+    send_server_messagev(s, LANE_INTERACTIVE, CMD_PART, s->parts,
+            s->partreason, NULL);
+    s->last_client = NULL;
+
+    *s->parts = '\0';
+    free(s->partreason);
+    s->partreason = NULL;
+}
+
+/* send everything that is waiting to the server */
+void send_channel_batch(Server *s) {
+    del_timer(&(s->chantimer));
+    send_joins(s);
+    send_parts(s);
+}
+
+/* nothing more has come along to go in the same lines, so send them */
+static void handle_channel_timer(void *data) {
+    send_channel_batch(data);
+}
+
+/* append str to the comma-separated list */
+static void append_list(char *list, const char *str) {
+    char *endptr = NULL;
+
+    if(*list)
+        strappend(list, &endptr, 512, ",");
+    strappend(list, &endptr, 512, str);
+}
+
+/* wait a little while before sending the server a JOIN or PART, in case
+ * more come that can go in the same line
+ */
+static void wait_channel_batch(Server *s) {
+    if(!s->chantimer.armed)
+        add_timer(&(s->chantimer), CHANNEL_BATCH_TIME, handle_channel_timer,
+                s);
+}
+
+/* add a channel to the JOIN line that is waiting to be sent */
+static void batch_join(Server *s, const char *channel, const char *key) {
+    /* PARTs that were made first must be sent first */
+    send_parts(s);
+
+    /* "JOIN <channels> <keys>\r\n" must fit in 512 bytes */
+    size_t len = 5 + strlen(s->keyed) + 1 + strlen(s->joins) + 1
+        + strlen(channel) + 1 + strlen(s->keys) + (key ? strlen(key) + 1 : 0)
+        + 2;
+    if(len > 512)
+        send_joins(s);
+
+    if(key) {
+        append_list(s->keyed, channel);
+        append_list(s->keys, key);
+    } else {
+        append_list(s->joins, channel);
+    }
+
+    wait_channel_batch(s);
+}
+
+/* add a channel to the PART line that is waiting to be sent */
+static void batch_part(Server *s, const char *channel, const char *reason) {
+    /* JOINs that were made first must be sent first */
+    send_joins(s);
+
+    /* a PART line has only one reason */
+    if(*s->parts && (reason || s->partreason) && (!reason || !s->partreason
+                || strcmp(reason, s->partreason) != 0))
+        send_parts(s);
+
+    /* "PART <channels> :<reason>\r\n" must fit in 512 bytes */
+    size_t len = 5 + strlen(s->parts) + 1 + strlen(channel)
+        + (reason ? strlen(reason) + 2 : 0) + 2;
+    if(len > 512)
+        send_parts(s);
+
+    append_list(s->parts, channel);
+    if(reason && !s->partreason)
+        s->partreason = strdup(reason);
+
+    wait_channel_batch(s);
+}
+
+/* join the channel, with the key if it is not NULL */
+void join_channel(Server *s, const char *channel, const char *key) {
+    Channel *chan = lookup_channel(s, channel);
 
     /* if the channel doesn't exist yet, make it */
     if(!chan) {
-        chan = new_channel();
-        chan->name = strdup(channel);
-        prepend_channel(chan, &(s->channel_list));
+        chan = add_channel(s, channel);
         chan->state = CHAN_JOINING;
     }
 
+    /* remember the key in case we have to join again */
+    if(key)
+        set_channel_key(chan, key);
+
     /* send a (possibly duplicate) join message if we've not joined yet */
     if(chan->state != CHAN_JOINED)
-        send_socket_messagev(s->sock, NULL, NULL, NULL, CMD_JOIN,
-                channel, NULL);
+        batch_join(s, channel, key);
 }
 
 /* mark the channel with the given name as successfully joined */
 void joined_channel(Server *s, const char *channel) {
-    Channel *chan = lookup_channel(s->channel_list, channel);
+    Channel *chan = lookup_channel(s, channel);
 
     /* if the channel does not exist, make it
      * TODO: should this just instantly part instead?
      */
-    if(!chan) {
-        chan = new_channel();
-        chan->name = strdup(channel);
-        prepend_channel(chan, &(s->channel_list));
+    if(!chan)
+        chan = add_channel(s, channel);
+
+    /* the server will tell us who is in the channel and what the topic is;
+     * if we are rejoining, keep what we knew so that clients can be told
+     * what has changed
+     */
+    if(chan->rejoin_state == REJOIN_WAITING) {
+        chan->oldmembers = chan->members;
+        init_table(&(chan->members), member_nick, s->casemapping);
+        chan->oldtopic = chan->topic;
+        chan->topic = NULL;
+        chan->rejoin_state = REJOIN_READING;
+    } else {
+        clear_members(s, chan);
     }
+    chan->names_state = NAMES_NONE;
+    chan->gottopic = 0;
 
     chan->state = CHAN_JOINED;
 }
 
-/* attempt to part the channel */
-int part_channel(Server *s, const char *channel) {
-    return send_socket_messagev(s->sock, s->nick, s->user,
-            s->host, CMD_PART, channel, NULL);
+/* attempt to part the channel, giving the reason if it is not NULL */
+void part_channel(Server *s, const char *channel, const char *reason) {
+    batch_part(s, channel, reason);
 }
 
 /* we have parted, delete the channel */
 void parted_channel(Server *s, const char *channel) {
-    Channel *chan = lookup_channel(s->channel_list, channel);
+    Channel *chan = lookup_channel(s, channel);
 
     /* if the channel exists, delete it */
     if(chan)
-        free_channel(chan, &(s->channel_list));
+        remove_channel(s, chan);
+}
+
+/* set the channel key, or forget it if key is NULL */
+void set_channel_key(Channel *chan, const char *key) {
+    char *old = chan->key;
+
+    chan->key = key ? strdup(key) : NULL;
+    free(old);
+}
+
+/* the connection to the server has gone, so forget the JOINs and PARTs that
+ * were waiting to be sent, and mark every channel we were in as needing to
+ * be rejoined; clients still think we are in them
+ */
+void lost_channels(Server *s) {
+    Channel *chan;
+    int h = 0;
+
+    del_timer(&(s->chantimer));
+    *s->joins = *s->keyed = *s->keys = *s->parts = '\0';
+    free(s->partreason);
+    s->partreason = NULL;
+
+    while((chan = next_channel(s, &h)))
+        if(chan->state == CHAN_JOINED && chan->rejoin_state == REJOIN_NONE)
+            chan->rejoin_state = REJOIN_WAITING;
+}
+
+/* join every channel again after reconnecting to the server, including
+ * those that we were still waiting to join
+ */
+void rejoin_channels(Server *s) {
+    Channel *chan;
+    int h = 0;
+
+    while((chan = next_channel(s, &h)))
+        batch_join(s, chan->name, chan->key);
+}
+
+/* tell clients about the mode prefixes the member has gained or lost */
+static void send_prefix_changes(Server *s, Channel *chan, const char *nick,
+        const char *oldprefix, const char *prefix) {
+    const char *c;
+    char mode[3];
+
+    for(c = s->prefix_chars; *c; c++) {
+        int had = strchr(oldprefix, *c) != NULL;
+        int has = strchr(prefix, *c) != NULL;
+
+        if(had == has)
+            continue;
+
+        mode[0] = has ? '+' : '-';
+        mode[1] = s->prefix_modes[c - s->prefix_chars];
+        mode[2] = '\0';
+        send_all_messagev(s, NULL, s->servername, NULL, NULL, CMD_MODE,
+                chan->name, mode, nick, NULL);
+    }
+}
+
+/* we have rejoined the channel and have the names and topic, so tell clients
+ * what changed while we were away, as if they had seen it happen
+ */
+void rejoined_channel(Server *s, Channel *chan) {
+    Member *member, *old;
+    size_t i = 0;
+
+    while((old = table_next(&(chan->oldmembers), &i)))
+        if(!find_member(&(chan->members), old->nick))
+            send_all_messagev(s, NULL, old->nick->str, NULL, NULL, CMD_PART,
+                    chan->name, NULL);
+
+    i = 0;
+    while((member = table_next(&(chan->members), &i))) {
+        old = find_member(&(chan->oldmembers), member->nick);
+        if(!old)
+            send_all_messagev(s, NULL, member->nick->str, NULL, NULL,
+                    CMD_JOIN, chan->name, NULL);
+        send_prefix_changes(s, chan, member->nick->str,
+                old ? old->prefix : "", member->prefix);
+    }
+
+    const char *topic = chan->topic ? chan->topic : "";
+    if(strcmp(topic, chan->oldtopic ? chan->oldtopic : "") != 0)
+        send_all_messagev(s, NULL, chan->topic_setter ? chan->topic_setter
+                : s->servername, NULL, NULL, CMD_TOPIC, chan->name, topic,
+                NULL);
+
+    clear_old_members(s, chan);
+    chan->rejoin_state = REJOIN_NONE;
+}
+
+/* set the channel topic, with an empty topic meaning there is none */
+void set_topic(Channel *chan, const char *topic) {
+    free(chan->topic);
+    free(chan->topic_setter);
+    chan->topic = *topic ? strdup(topic) : NULL;
+    chan->topic_setter = NULL;
+    chan->topic_time = 0;
+    chan->gottopic = 1;
+}
+
+/* record who set the channel topic and when */
+void set_topic_setter(Channel *chan, const char *setter, long when) {
+    free(chan->topic_setter);
+    chan->topic_setter = strdup(setter);
+    chan->topic_time = when;
+}
+
+/* send the client the channel topic (RPL_TOPIC and RPL_TOPICWHOTIME, or
+ * RPL_NOTOPIC) from what we know
+ */
+void send_topic(Client *c, Channel *chan) {
+    Server *s = c->server;
+
+    if(!chan->topic) {
+        send_socket_messagev(&c->sock, s->servername, NULL, NULL, RPL_NOTOPIC,
+                s->nick, chan->name, "No topic is set", NULL);
+        return;
+    }
+
+    send_socket_messagev(&c->sock, s->servername, NULL, NULL, RPL_TOPIC,
+            s->nick, chan->name, chan->topic, NULL);
+
+    if(chan->topic_setter) {
+        char when[32];
+        snprintf(when, sizeof(when), "%ld", chan->topic_time);
+        send_socket_messagev(&c->sock, s->servername, NULL, NULL,
+                RPL_TOPICWHOTIME, s->nick, chan->name, chan->topic_setter,
+                when, NULL);
+    }
+}
+
+/* give (if set is non-zero) or take away the prefix mode (e.g. 'o') from the
+ * member, keeping their prefixes in rank order
+ */
+static void set_prefix(Server *s, Member *member, char mode, int set) {
+    const char *m = strchr(s->prefix_modes, mode);
+    char prefix[sizeof(member->prefix)];
+    const char *c;
+    int n = 0;
+
+    if(!m || !mode)
+        return;
+
+    char p = s->prefix_chars[m - s->prefix_modes];
+
+    /* rebuild the prefixes in rank order, with or without this one */
+    for(c = s->prefix_chars; *c && n < sizeof(prefix) - 1; c++) {
+        if(*c == p ? set : strchr(member->prefix, *c) != NULL)
+            prefix[n++] = *c;
+    }
+    prefix[n] = '\0';
+
+    strcpy(member->prefix, prefix);
+}
+
+/* add nick (which may have mode prefixes, as in RPL_NAMREPLY) to the
+ * channel, or update their prefixes if they are already in it
+ */
+void add_member(Server *s, Channel *chan, const char *nick) {
+    size_t nprefix = strspn(nick, s->prefix_chars);
+    size_t len = strcspn(nick + nprefix, "!");
+    Member *member;
+    Name *n;
+    char name[len + 1];
+
+    /* drop the user@host of userhost-in-names */
+    memcpy(name, nick + nprefix, len);
+    name[len] = '\0';
+
+    n = intern_name(&(s->names), name);
+    if((member = find_member(&(chan->members), n))) {
+        free_name(&(s->names), n);
+    } else {
+        member = malloc(sizeof(Member));
+        memset(member->prefix, 0, sizeof(member->prefix));
+        member->nick = n;
+        table_insert_hash(&(chan->members), member, n->hash);
+    }
+
+    size_t i;
+    for(i = 0; i < nprefix; i++)
+        set_prefix(s, member, s->prefix_modes[strchr(s->prefix_chars,
+                    nick[i]) - s->prefix_chars], 1);
+}
+
+/* remove nick from the channel */
+void remove_member(Server *s, Channel *chan, const char *nick) {
+    Name *n = find_name(&(s->names), nick);
+    Member *member;
+
+    if(n && (member = table_remove_hash(&(chan->members), n->str, n->hash)))
+        free_member(s, member);
+}
+
+/* change the nick of a user in every channel they are in */
+void rename_member(Server *s, const char *oldnick, const char *newnick) {
+    Name *from = find_name(&(s->names), oldnick), *to;
+    Channel *chan;
+    int h = 0;
+
+    /* nobody we know of has the nick */
+    if(!from)
+        return;
+
+    /* a case-only change leaves everyone with the same name */
+    to = intern_name(&(s->names), newnick);
+    if(to == from) {
+        respell_name(to, newnick);
+        free_name(&(s->names), to);
+        return;
+    }
+
+    /* from mustn't go away until every channel is done with */
+    ref_name(from);
+
+    while((chan = next_channel(s, &h))) {
+        Member *member = table_remove_hash(&(chan->members), from->str,
+                from->hash);
+        if(!member)
+            continue;
+
+        /* nobody else can still have the new nick */
+        Member *gone = table_remove_hash(&(chan->members), to->str, to->hash);
+        if(gone)
+            free_member(s, gone);
+
+        free_name(&(s->names), member->nick);
+        member->nick = ref_name(to);
+        table_insert_hash(&(chan->members), member, to->hash);
+    }
+
+    free_name(&(s->names), from);
+    free_name(&(s->names), to);
+}
+
+/* remove a user who has quit from every channel */
+void quit_member(Server *s, const char *nick) {
+    Name *n = find_name(&(s->names), nick);
+    Channel *chan;
+    int h = 0;
+
+    if(!n)
+        return;
+
+    ref_name(n);
+
+    while((chan = next_channel(s, &h))) {
+        Member *member = table_remove_hash(&(chan->members), n->str, n->hash);
+        if(member)
+            free_member(s, member);
+    }
+
+    free_name(&(s->names), n);
+}
+
+/* give (if set is non-zero) or take away the prefix mode (e.g. 'o') from the
+ * member of the channel
+ */
+void set_member_mode(Server *s, Channel *chan, const char *nick, char mode,
+        int set) {
+    Name *n = find_name(&(s->names), nick);
+    Member *member;
+
+    if(n && (member = find_member(&(chan->members), n)))
+        set_prefix(s, member, mode, set);
+}
+
+/* change the casemapping used for channel members */
+void set_channel_casemap(Server *s, int casemap) {
+    Channel *chan;
+    int h = 0;
+
+    while((chan = next_channel(s, &h))) {
+        table_set_casemap(&(chan->members), casemap);
+        table_set_casemap(&(chan->oldmembers), casemap);
+    }
+}
+
+/* send the client RPL_NAMREPLY and RPL_ENDOFNAMES for the channel from the
+ * members we know about, with as many names in each line as will fit
+ */
+void send_names(Client *c, Channel *chan) {
+    Server *s = c->server;
+    char line[513];
+    size_t prefixlen, len;
+    Member *member;
+    size_t i = 0;
+
+    prefixlen = snprintf(line, sizeof(line), ":%s 353 %s %c %s :",
+            s->servername, s->nick, chan->symbol, chan->name);
+    /* with so little room left for names, let the server split them up */
+    if(prefixlen >= 400) {
+        request_messagev(c, CMD_NAMES, chan->name, NULL);
+        return;
+    }
+    len = prefixlen;
+
+    while((member = table_next(&(chan->members), &i))) {
+        size_t n = member->nick->len + (member->prefix[0] != '\0');
+
+        /* a nick that couldn't fit in a line of its own can't be sent */
+        if(prefixlen + n > 510)
+            continue;
+
+        /* send this line if the name won't fit, leaving room for \r\n */
+        if(len > prefixlen && len + 1 + n > 510) {
+            memcpy(line + len, "\r\n", 2);
+            send_socket_string(&c->sock, line, len + 2);
+            len = prefixlen;
+        }
+
+        if(len > prefixlen)
+            line[len++] = ' ';
+
+        /* only the highest prefix, as the client can't have asked for
+         * multi-prefix
+         */
+        if(member->prefix[0])
+            line[len++] = member->prefix[0];
+        memcpy(line + len, member->nick->str, member->nick->len);
+        len += member->nick->len;
+    }
+
+    if(len > prefixlen) {
+        memcpy(line + len, "\r\n", 2);
+        send_socket_string(&c->sock, line, len + 2);
+    }
+
+    send_socket_messagev(&c->sock, s->servername, NULL, NULL, RPL_ENDOFNAMES,
+            s->nick, chan->name, "End of /NAMES list.", NULL);
 }
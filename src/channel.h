@@ -6,22 +6,77 @@
 #ifndef CHANNEL_H_INC
 #define CHANNEL_H_INC
 
+/* a user in a channel, with the prefixes of their channel modes (e.g. "@+")
+ * in the order the server ranks them
+ */
+typedef struct Member {
+    char prefix[8];
+    struct Name *nick;
+} Member;
+
+/* a channel, which is kept in its server's channel slab; order is where its
+ * handle is in the server's channel order
+ */
 typedef struct Channel {
+    int handle;
+    int order;
     char *name;
+    char *key;
     char *topic;
+    char *topic_setter;
+    long topic_time;
+    int gottopic;
     int state;
-    struct Channel *prev, *next;
+    char symbol;
+    int names_state;
+    Table members;
+    int rejoin_state;
+    Table oldmembers;
+    char *oldtopic;
 } Channel;
 
 enum { CHAN_JOINING, CHAN_JOINED };
 
-Channel *new_channel(void);
-void free_channel(Channel *chan, Channel **list);
-Channel *prepend_channel(Channel *chan, Channel **list);
-Channel *lookup_channel(Channel *list, const char *channel);
-void join_channel(Server *s, const char *channel);
+/* after reconnecting to the server, a channel we were in is REJOIN_WAITING
+ * until the server says we have joined it, and then REJOIN_READING while the
+ * names and topic come in to be compared with what we knew before (which is
+ * kept in oldmembers and oldtopic)
+ */
+enum { REJOIN_NONE, REJOIN_WAITING, REJOIN_READING };
+
+/* JOINs and PARTs made within this many milliseconds of each other are sent
+ * to the server together
+ */
+#define CHANNEL_BATCH_TIME 50
+
+/* NAMES_HAVE means members is a complete list of who is in the channel */
+enum { NAMES_NONE, NAMES_READING, NAMES_HAVE };
+
+Channel *new_channel(Server *s);
+const char *channel_name(const void *chan);
+void free_channel(Server *s, Channel *chan);
+Channel *next_channel(Server *s, int *h);
+Channel *lookup_channel(Server *s, const char *channel);
+void send_channel_batch(Server *s);
+void join_channel(Server *s, const char *channel, const char *key);
 void joined_channel(Server *s, const char *channel);
-int part_channel(Server *s, const char *channel);
+void part_channel(Server *s, const char *channel, const char *reason);
 void parted_channel(Server *s, const char *channel);
+void set_channel_key(Channel *chan, const char *key);
+void lost_channels(Server *s);
+void rejoin_channels(Server *s);
+void rejoined_channel(Server *s, Channel *chan);
+void set_topic(Channel *chan, const char *topic);
+void set_topic_setter(Channel *chan, const char *setter, long when);
+void send_topic(Client *c, Channel *chan);
+void clear_members(Server *s, Channel *chan);
+void add_member(Server *s, Channel *chan, const char *nick);
+void remove_member(Server *s, Channel *chan, const char *nick);
+void rename_member(Server *s, const char *oldnick, const char *newnick);
+void quit_member(Server *s, const char *nick);
+void set_member_mode(Server *s, Channel *chan, const char *nick, char mode,
+        int set);
+void set_channel_casemap(Server *s, int casemap);
+void send_names(Client *c, Channel *chan);
 
 #endif
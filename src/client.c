@@ -7,12 +7,23 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdarg.h>
 
+#include "event.h"
+#include "buffer.h"
+#include "table.h"
+#include "slab.h"
 #include "socket.h"
+#include "worker.h"
+#include "connect.h"
+#include "pool.h"
+#include "sched.h"
 #include "message.h"
 #include "client.h"
+#include "config.h"
 #include "server.h"
 #include "channel.h"
+#include "request.h"
 
 typedef int(*ClientMessageHandler)(Client *, const Message *);
 
@@ -25,6 +36,8 @@ static int handle_pass(Client *, const Message *);
 static int handle_nick(Client *, const Message *);
 static int handle_user(Client *, const Message *);
 static int handle_privmsg(Client *, const Message *);
+static int handle_mode(Client *, const Message *);
+static int handle_names(Client *, const Message *);
 static int handle_quit(Client *, const Message *);
 
 /* initialise handler functions for client messages */
@@ -37,57 +50,84 @@ void init_client_handlers(void) {
     message_handler[CMD_PRIVMSG] = handle_privmsg;
     message_handler[CMD_QUIT] = handle_quit;
     message_handler[CMD_CAP] = handle_ignore;
+    message_handler[CMD_MOTD] = handle_request;
+    message_handler[CMD_LIST] = handle_request;
+    message_handler[CMD_LUSERS] = handle_request;
+    message_handler[CMD_VERSION] = handle_request;
+    message_handler[CMD_ADMIN] = handle_request;
+    message_handler[CMD_INFO] = handle_request;
+    message_handler[CMD_WHO] = handle_request;
+    message_handler[CMD_WHOIS] = handle_request;
+    message_handler[CMD_MODE] = handle_mode;
+    message_handler[CMD_NAMES] = handle_names;
 }
 
-/* return a new empty client */
-Client *new_client(void) {
-    Client *c = malloc(sizeof(Client));
-    memset(c, 0, sizeof(Client));
-    c->sock = new_socket();
+/* return a new empty client of the server */
+Client *new_client(Server *s) {
+    int h = slab_alloc(&(s->client_slab));
+    Client *c = slab_item(&(s->client_slab), h);
+
+    init_socket(&c->sock);
+    c->sock.maxqueue = CLIENT_MAX_QUEUE;
+    c->handle = h;
+    c->server = s;
+    s->nclients++;
+
     return c;
 }
 
-/* remove c from its list and free it */
+/* stop counting the client as one of the server's, as it is going away */
+static void remove_client(Client *c) {
+    c->server->nclients--;
+    c->closing = 1;
+}
+
+/* free the client */
 void free_client(Client *c) {
-    if(c->prev)
-        c->prev->next = c->next;
-    if(c->next)
-        c->next->prev = c->prev;
+    if(!c->closing)
+        remove_client(c);
 
-    free(c->sock);
-    free(c);
+    clear_socket(&c->sock);
+    free(c->pass);
+    slab_free(&(c->server->client_slab), c->handle);
 }
 
-/* prepend a client to the list pointed to by list, point list to c,
- * and return the new head
+/* return the next of the server's clients (leaving out those that are going
+ * away), starting from handle *h and updating it to continue from there next
+ * time, or NULL if there are no more; start with *h = 0
  */
-Client *prepend_client(Client *c, Client **list) {
-    if(*list) {
-        if((*list)->prev)
-            (*list)->prev->next = c;
-        c->prev = (*list)->prev;
-        c->next = *list;
-        (*list)->prev = c;
-    } else {
-        c->prev = NULL;
-        c->next = NULL;
-    }
+Client *next_client(Server *s, int *h) {
+    Client *c;
 
-    *list = c;
+    while((c = slab_next(&(s->client_slab), h)))
+        if(!c->closing)
+            return c;
 
-    return *list;
+    return NULL;
 }
 
 /* disconnect, remove and free this client */
 void disconnect_client(Client *c) {
-    close(c->sock->fd);
+    /* make a last attempt at sending anything that is still queued (e.g. an
+     * error message explaining the disconnection)
+     */
+    flush_socket(&c->sock);
+
+    /* nobody should try to give this client the replies it asked for */
+    cancel_requests(c);
 
-    /* if this is the first client in the list, point the list at the next
-     * client
+    del_event(&c->sock.ev);
+
+    /* a worker's client is closed by the worker, which sends what is still
+     * queued first, and is only freed once the worker hands it back
      */
-    if(c->server->client_list == c)
-        c->server->client_list = c->next;
+    if(c->sock.peer) {
+        remove_client(c);
+        close_peer(c->sock.peer);
+        return;
+    }
 
+    close(c->sock.fd);
     free_client(c);
 }
 
@@ -95,17 +135,73 @@ void disconnect_client(Client *c) {
  * command
  */
 int need_more_params(Client *c, const char *command) {
-    return send_socket_messagev(c->sock, c->server->host, NULL, NULL,
+    return send_socket_messagev(&c->sock, c->server->host, NULL, NULL,
             ERR_NEEDMOREPARAMS, c->server->nick, command,
             "Not enough parameters", NULL);
 }
 
+/* handle an event on the client socket; errors are only ever delivered as
+ * deferred events, so it is safe to free the client here
+ */
+void handle_client_event(void *data, int events) {
+    Client *c = data;
+
+    if(events & EV_ERROR) {
+        disconnect_client(c);
+        return;
+    }
+
+    if(events & EV_READ)
+        handle_client_data(c);
+    if(events & EV_WRITE)
+        flush_socket(&c->sock);
+}
+
+/* write the state of the client to stderr */
+void dump_client_stats(Client *c) {
+    /* a worker's queue isn't ours to look at */
+    if(c->sock.peer)
+        fprintf(stderr, "  client fd %d: %s, on worker %d\n", c->sock.fd,
+                c->authd ? "authenticated" : "unauthenticated",
+                (int)(c->sock.peer->worker - c->server->workers->worker));
+    else
+        fprintf(stderr, "  client fd %d: %s, %zu bytes queued in %d "
+                "buffers\n", c->sock.fd,
+                c->authd ? "authenticated" : "unauthenticated",
+                c->sock.outq.bytes, c->sock.outq.nnodes);
+}
+
+/* handle something that a worker has done for one of the clients */
+void handle_client_job(Job *j) {
+    Client *c = j->client;
+
+    switch(j->type) {
+    case JOB_MESSAGE:
+        /* as with our own clients, nothing more is handled from a client
+         * once it has gone wrong
+         */
+        if(!c->closing && !c->sock.error)
+            handle_client_message(c, j->m);
+        free_message(j->m);
+        break;
+    case JOB_ERROR:
+        if(!c->closing)
+            set_socket_error(&c->sock, -1);
+        break;
+    case JOB_CLOSED:
+        free_client(c);
+        break;
+    }
+}
+
 /* read from the client and deal with the messages */
 void handle_client_data(Client *c) {
-    /* read data into the buffer and handle messages if there is no error */
-    if(read_data(c->sock) == 0)
-        handle_messages(c->sock, (GenericMessageHandler)handle_client_message,
+    /* read until there is nothing left, handling messages as we go */
+    while(!c->sock.error && read_data(&c->sock) > 0)
+        handle_messages(&c->sock, (GenericMessageHandler)handle_client_message,
                 c);
+
+    shrink_socket_buffer(&c->sock);
 }
 
 /* handle a message from the given client (ignore any invalid ones) */
@@ -113,9 +209,9 @@ int handle_client_message(Client *c, const Message *m) {
     if(!c->authd && m->command != CMD_PASS) {
         if(!c->pass || strcmp(c->pass, c->server->pass) != 0) {
             /* incorrect password, fail and disconnect the client soon */
-            send_socket_messagev(c->sock, c->server->host, NULL, NULL,
+            send_socket_messagev(&c->sock, c->server->host, NULL, NULL,
                     ERR_PASSWDMISMATCH, "*", "Incorrect password", NULL);
-            c->sock->error = 1;
+            set_socket_error(&c->sock, 1);
             return -1;
         } else {
             /* correct password */
@@ -128,7 +224,7 @@ int handle_client_message(Client *c, const Message *m) {
         return message_handler[m->command](c, m);
     } else {
         /* pass on un-handled messages */
-        send_socket_message(c->server->sock, m);
+        forward_message(c, m);
         return 0;
     }
 }
@@ -143,11 +239,28 @@ static int handle_join(Client *c, const Message *m) {
     if(m->nparams < 1)
         return need_more_params(c, "JOIN");
 
-    /* TODO: the first parameter (channel to join) can be a comma-separated
-     * list
-     */
+    /* "JOIN 0" parts every channel, which the server will tell us about */
+    if(strcmp(m->param[0], "0") == 0) {
+        forward_message(c, m);
+        return 0;
+    }
+
+    /* the channels and their keys are comma-separated lists */
+    char channels[strlen(m->param[0]) + 1];
+    char keys[m->nparams > 1 ? strlen(m->param[1]) + 1 : 1];
+    char *channel, *key, *chansave, *keysave;
+
+    strcpy(channels, m->param[0]);
+    strcpy(keys, m->nparams > 1 ? m->param[1] : "");
+
+    key = strtok_r(keys, ",", &keysave);
+    for(channel = strtok_r(channels, ",", &chansave); channel;
+            channel = strtok_r(NULL, ",", &chansave)) {
+        join_channel(c->server, channel, key);
+        if(key)
+            key = strtok_r(NULL, ",", &keysave);
+    }
 
-    join_channel(c->server, m->param[0]);
     return 0;
 }
 
@@ -158,11 +271,17 @@ static int handle_part(Client *c, const Message *m) {
     if(m->nparams < 1)
         return need_more_params(c, "PART");
 
-    /* TODO: the first parameter (channel to join) can be a comma-separated
-     * list
-     */
+    /* the channels are a comma-separated list */
+    char channels[strlen(m->param[0]) + 1];
+    char *channel, *saveptr;
+
+    const char *reason = m->nparams > 1 ? m->param[1] : NULL;
+
+    strcpy(channels, m->param[0]);
+    for(channel = strtok_r(channels, ",", &saveptr); channel;
+            channel = strtok_r(NULL, ",", &saveptr))
+        part_channel(c->server, channel, reason);
 
-    part_channel(c->server, m->param[0]);
     return 0;
 }
 
@@ -193,20 +312,20 @@ static int handle_nick(Client *c, const Message *m) {
         /* this is not the first nick supplied by this client, or it is the
          * first nick supplied by any client: we really have to change nick
          */
-        send_socket_message(c->server->sock, m);
+        forward_message(c, m);
         return 0;
     } else {
         /* inform the client about what his nick really is */
         c->gotnick = 1;
 
-        int r = send_socket_messagev(c->sock, m->param[0], NULL, NULL,
+        int r = send_socket_messagev(&c->sock, m->param[0], NULL, NULL,
                 CMD_NICK, c->server->nick, NULL);
 
         /* if the server doesn't have a nick yet (i.e. doesn't have any other
          * clients who will have set a nick), request the nick
          */
-        if(!c->server->client_list->next)
-            send_socket_message(c->server->sock, m);
+        if(c->server->nclients == 1)
+            forward_message(c, m);
 
         return r;
     }
@@ -214,33 +333,35 @@ static int handle_nick(Client *c, const Message *m) {
 
 /* tell the client the welcome messages */
 static int handle_user(Client *c, const Message *m) {
-    int i;
-
-    for(i = 0; i < c->server->nwelcomes; i++)
-        if(send_socket_message(c->sock, c->server->welcomemsg[i]))
-            break;
+    int r = 0;
 
-    int r = i != c->server->nwelcomes;
+    /* all in one go, as they are kept ready with our current nick */
+    if(c->server->nwelcomes)
+        r = send_socket_buffer(&c->sock, welcome_buffer(c->server));
 
     /* find out the user modes */
-    send_socket_messagev(c->server->sock, NULL, NULL, NULL, CMD_MODE,
-            c->server->nick, NULL);
+    request_messagev(c, CMD_MODE, c->server->nick, NULL);
 
-    /* request an MOTD for this client */
-    c->motd_state = MOTD_WANT;
+    /* give this client an MOTD, from the cache if possible */
+    request_messagev(c, CMD_MOTD, NULL);
 
     /* tell this client what channels he is in */
     Channel *chan;
-    for(chan = c->server->channel_list; chan; chan = chan->next) {
-        send_socket_messagev(c->sock, c->server->nick, c->server->user,
+    int h = 0;
+    while((chan = next_channel(c->server, &h))) {
+        send_socket_messagev(&c->sock, c->server->nick, c->server->user,
                 c->server->host, CMD_JOIN, chan->name, NULL);
 
-        /* also get topic and names */
-        /* TODO: keep track of these and send it only to this client */
-        send_socket_messagev(c->server->sock, NULL, NULL, NULL,
-                CMD_TOPIC, chan->name, NULL);
-        send_socket_messagev(c->server->sock, NULL, NULL, NULL,
-                CMD_NAMES, chan->name, NULL);
+        /* the topic and names come from what we know, if we know it */
+        if(chan->gottopic)
+            send_topic(c, chan);
+        else
+            request_messagev(c, CMD_TOPIC, chan->name, NULL);
+
+        if(chan->names_state == NAMES_HAVE)
+            send_names(c, chan);
+        else
+            request_messagev(c, CMD_NAMES, chan->name, NULL);
     }
 
     return r;
@@ -258,16 +379,49 @@ static int handle_privmsg(Client *c, const Message *m) {
         send_all_messagev(c->server, c, c->server->nick, c->server->user,
                 c->server->host, m->command, m->param[0], m->param[1], NULL);
 
-    /* always forward the message to the server */
-    send_socket_message(c->server->sock, m);
+    /* always forward the message to the server, so that errors (e.g. no
+     * such nick) come back to this client
+     */
+    forward_message(c, m);
 
     return 0;
 }
 
+/* share mode queries with other clients; mode changes go straight to the
+ * server
+ */
+static int handle_mode(Client *c, const Message *m) {
+    if(m->nparams == 1)
+        return handle_request(c, m);
+
+    forward_message(c, m);
+    return 0;
+}
+
+/* answer NAMES for a channel we know all about ourselves, and share other
+ * NAMES queries with other clients
+ */
+static int handle_names(Client *c, const Message *m) {
+    Channel *chan;
+
+    if(m->nparams == 0) {
+        forward_message(c, m);
+        return 0;
+    }
+
+    if(m->nparams == 1 && (chan = lookup_channel(c->server, m->param[0]))
+            && chan->names_state == NAMES_HAVE) {
+        send_names(c, chan);
+        return 0;
+    }
+
+    return handle_request(c, m);
+}
+
 /* disconnect this client (actually just put it in the error state so that it
  * is disconnected at the next opportunity)
  */
 static int handle_quit(Client *c, const Message *m) {
-    c->sock->error = 1;
+    set_socket_error(&c->sock, 1);
     return 0;
 }
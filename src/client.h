@@ -6,25 +6,32 @@
 #ifndef CLIENT_H_INC
 #define CLIENT_H_INC
 
+/* a client, which is kept in its server's client slab; the socket comes
+ * first, as it is all that sending a line to every client looks at
+ */
 typedef struct Client {
-    int motd_state;
+    Socket sock;
+    int handle;
     int gotnick;
     int authd;
+    int closing;
     char *pass;
-    struct Socket *sock;
     struct Server *server;
-    struct Client *prev, *next;
 } Client;
 
-enum {
-    MOTD_HAPPY=0, MOTD_WANT, MOTD_READING
-};
+/* clients with more than this many bytes waiting to be sent to them are
+ * disconnected
+ */
+#define CLIENT_MAX_QUEUE (1024 * 1024)
 
 void init_client_handlers(void);
-Client *new_client(void);
+Client *new_client(struct Server *s);
 void free_client(Client *c);
-Client *prepend_client(Client *c, Client **list);
+Client *next_client(struct Server *s, int *h);
 void disconnect_client(Client *c);
+void handle_client_event(void *data, int events);
+void dump_client_stats(Client *c);
+void handle_client_job(struct Job *j);
 void handle_client_data(Client *c);
 int handle_client_message(Client *c, const struct Message *m);
 
@@ -0,0 +1,151 @@
+/* Config handling for muxirc
+ *
+ * James Stanley 2012
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "config.h"
+
+/* start with no networks and one thread */
+void init_config(Config *c) {
+    memset(c, 0, sizeof(Config));
+    c->nthreads = 1;
+}
+
+/* add a network with the given name to the config, with the same defaults
+ * as the command line, and return it
+ */
+Network *add_network(Config *c, const char *name) {
+    Network *net;
+
+    c->network = realloc(c->network, (c->nnetworks + 1) * sizeof(Network));
+    net = c->network + c->nnetworks++;
+    memset(net, 0, sizeof(Network));
+
+    net->name = strdup(name);
+    net->servers = strdup("irc.freenode.net");
+    net->port = strdup("6667");
+    net->username = strdup("muxirc");
+    net->realname = strdup("IRC Multiplexer");
+    net->listenport = strdup("10000");
+    net->pass = strdup("password");
+
+    return net;
+}
+
+/* replace the string pointed to by field with a copy of value */
+static void set_field(char **field, const char *value) {
+    free(*field);
+    *field = strdup(value);
+}
+
+/* handle a line of the config file, which is a keyword followed by its
+ * value; net is the network that the line applies to, which a "network"
+ * line changes; return 0 on success and -1 on error, having said what was
+ * wrong
+ */
+static int config_line(Config *c, Network **net, char *line,
+        const char *path, int lineno) {
+    char *key = line, *value, *end;
+
+    while(isspace((unsigned char)*key))
+        key++;
+    if(*key == '\0' || *key == '#')
+        return 0;
+
+    /* the value is everything after the keyword, without the spaces around
+     * it
+     */
+    value = key + strcspn(key, " \t\r\n");
+    if(*value)
+        *value++ = '\0';
+    while(isspace((unsigned char)*value))
+        value++;
+    end = value + strlen(value);
+    while(end > value && isspace((unsigned char)end[-1]))
+        *--end = '\0';
+
+    if(*value == '\0') {
+        fprintf(stderr, "%s:%d: %s needs a value\n", path, lineno, key);
+        return -1;
+    }
+
+    if(strcmp(key, "threads") == 0) {
+        c->nthreads = atoi(value);
+        if(c->nthreads < 1) {
+            fprintf(stderr, "%s:%d: bad number of threads\n", path, lineno);
+            return -1;
+        }
+    } else if(strcmp(key, "workers") == 0) {
+        c->nworkers = atoi(value);
+        if(c->nworkers < 0) {
+            fprintf(stderr, "%s:%d: bad number of workers\n", path, lineno);
+            return -1;
+        }
+    } else if(strcmp(key, "network") == 0) {
+        *net = add_network(c, value);
+    } else if(!*net) {
+        fprintf(stderr, "%s:%d: %s must come after network\n", path, lineno,
+                key);
+        return -1;
+    } else if(strcmp(key, "servers") == 0) {
+        set_field(&((*net)->servers), value);
+    } else if(strcmp(key, "port") == 0) {
+        set_field(&((*net)->port), value);
+    } else if(strcmp(key, "serverpass") == 0) {
+        set_field(&((*net)->serverpass), value);
+    } else if(strcmp(key, "username") == 0) {
+        set_field(&((*net)->username), value);
+    } else if(strcmp(key, "realname") == 0) {
+        set_field(&((*net)->realname), value);
+    } else if(strcmp(key, "listen") == 0) {
+        set_field(&((*net)->listenport), value);
+    } else if(strcmp(key, "password") == 0) {
+        set_field(&((*net)->pass), value);
+    } else {
+        fprintf(stderr, "%s:%d: unknown keyword %s\n", path, lineno, key);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* read the config file at path, in which "threads <n>" and "workers <n>"
+ * apply to the whole process, "network <name>" starts a new network, and the
+ * rest apply to the network before them:
+ *   servers <host[:port],...>   port <port>   serverpass <password>
+ *   username <user>   realname <name>   listen <port>   password <password>
+ * blank lines and lines starting with '#' are ignored; return 0 on success
+ * and -1 on error
+ */
+int read_config(Config *c, const char *path) {
+    FILE *fp;
+    char line[1024];
+    int lineno = 0;
+    Network *net = NULL;
+
+    if(!(fp = fopen(path, "r"))) {
+        perror(path);
+        return -1;
+    }
+
+    while(fgets(line, sizeof(line), fp)) {
+        if(config_line(c, &net, line, path, ++lineno) == -1) {
+            fclose(fp);
+            return -1;
+        }
+    }
+
+    fclose(fp);
+
+    if(c->nnetworks == 0) {
+        fprintf(stderr, "%s: no networks\n", path);
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,35 @@
+/* Config handling for muxirc
+ *
+ * James Stanley 2012
+ */
+
+#ifndef CONFIG_H_INC
+#define CONFIG_H_INC
+
+/* an IRC network to connect to, and how clients reach it */
+typedef struct Network {
+    char *name;
+    char *servers;
+    char *port;
+    char *serverpass;
+    char *username;
+    char *realname;
+    char *listenport;
+    char *pass;
+} Network;
+
+/* the networks, how many event-loop threads to share them between, and how
+ * many worker threads each of those has for its clients
+ */
+typedef struct Config {
+    int nthreads;
+    int nworkers;
+    int nnetworks;
+    Network *network;
+} Config;
+
+void init_config(Config *c);
+Network *add_network(Config *c, const char *name);
+int read_config(Config *c, const char *path);
+
+#endif
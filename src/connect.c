@@ -0,0 +1,349 @@
+/* Connection handling for muxirc
+ *
+ * James Stanley 2012
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "event.h"
+#include "connect.h"
+
+/* a name being looked up by a resolver thread; the thread owns it until it
+ * has written a pointer to it down the pipe, and then whoever reads it does
+ */
+typedef struct Resolve {
+    char *host;
+    char *port;
+    int fd;
+    int error;
+    struct addrinfo *addrs;
+} Resolve;
+
+static void start_attempt(Connector *cn);
+
+/* free the lookup and its result */
+static void free_resolve(Resolve *r) {
+    free(r->host);
+    free(r->port);
+    if(r->addrs)
+        freeaddrinfo(r->addrs);
+    free(r);
+}
+
+/* look up the name without holding up the event loop, and hand the result
+ * back through the pipe; if nobody is listening any more, throw it away
+ */
+static void *resolve_thread(void *data) {
+    Resolve *r = data;
+    struct addrinfo hints;
+    int fd = r->fd;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+
+    r->error = getaddrinfo(r->host, r->port, &hints, &(r->addrs));
+
+    if(write(fd, &r, sizeof(r)) != sizeof(r))
+        free_resolve(r);
+    close(fd);
+
+    return NULL;
+}
+
+/* stop waiting for the resolver thread */
+static void stop_resolve(Connector *cn) {
+    Resolve *r;
+
+    if(cn->resolvefd == -1)
+        return;
+
+    /* a result that has arrived but not been read must be freed here; one
+     * that hasn't arrived yet is freed by the thread when it can't be written
+     */
+    if(read(cn->resolvefd, &r, sizeof(r)) == sizeof(r))
+        free_resolve(r);
+
+    del_event(&(cn->resolveev));
+    close(cn->resolvefd);
+    cn->resolvefd = -1;
+}
+
+/* give up on a connection attempt */
+static void close_attempt(Attempt *a) {
+    del_event(&(a->ev));
+    close(a->fd);
+    a->fd = -1;
+    a->cn->active--;
+}
+
+/* stop everything that is going on and tell the owner of the connector how
+ * it went: fd is the connected socket, or -1 on failure
+ */
+static void finish_connect(Connector *cn, int fd) {
+    int i;
+
+    del_timer(&(cn->delay));
+    del_timer(&(cn->timeout));
+    stop_resolve(cn);
+
+    for(i = 0; i < cn->next; i++)
+        if(cn->attempt[i].fd != -1)
+            close_attempt(cn->attempt + i);
+
+    if(cn->addrs) {
+        freeaddrinfo(cn->addrs);
+        cn->addrs = NULL;
+    }
+    cn->naddrs = 0;
+    cn->next = 0;
+
+    cn->handle(cn->data, fd);
+}
+
+/* return the first address from p onwards that is (if same is non-zero) or
+ * is not (otherwise) of the given family
+ */
+static struct addrinfo *next_family(struct addrinfo *p, int family,
+        int same) {
+    while(p && (p->ai_family == family) != same)
+        p = p->ai_next;
+    return p;
+}
+
+/* put the addresses in the order they are to be tried, alternating between
+ * address families and starting with the family of the address getaddrinfo
+ * likes best (RFC 8305 section 4)
+ */
+static void order_addrs(Connector *cn) {
+    int family = cn->addrs->ai_family;
+    struct addrinfo *first = next_family(cn->addrs, family, 1);
+    struct addrinfo *other = next_family(cn->addrs, family, 0);
+
+    cn->naddrs = 0;
+    while((first || other) && cn->naddrs < CONNECT_MAX_ATTEMPTS) {
+        if(first) {
+            cn->order[cn->naddrs++] = first;
+            first = next_family(first->ai_next, family, 1);
+        }
+        if(other && cn->naddrs < CONNECT_MAX_ATTEMPTS) {
+            cn->order[cn->naddrs++] = other;
+            other = next_family(other->ai_next, family, 0);
+        }
+    }
+}
+
+/* handle the name having been looked up by starting to connect */
+static void handle_resolve_event(void *data, int events) {
+    Connector *cn = data;
+    Resolve *r;
+    ssize_t n;
+
+    /* it is already taken care of */
+    if(cn->resolvefd == -1)
+        return;
+
+    while((n = read(cn->resolvefd, &r, sizeof(r))) == -1 && errno == EINTR)
+        ;
+
+    if(n == -1 && errno == EAGAIN && !(events & EV_ERROR))
+        return;
+
+    stop_resolve(cn);
+
+    if(n != sizeof(r)) {
+        fprintf(stderr, "resolver: no result\n");
+        finish_connect(cn, -1);
+        return;
+    }
+
+    if(r->error) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(r->error));
+        free_resolve(r);
+        finish_connect(cn, -1);
+        return;
+    }
+
+    cn->addrs = r->addrs;
+    r->addrs = NULL;
+    free_resolve(r);
+
+    order_addrs(cn);
+    start_attempt(cn);
+}
+
+/* handle a connection attempt becoming writable, which means it has either
+ * connected or failed
+ */
+static void handle_attempt_event(void *data, int events) {
+    Attempt *a = data;
+    Connector *cn = a->cn;
+    int error = 0;
+    socklen_t len = sizeof(error);
+
+    /* another attempt won, or this one has already failed */
+    if(a->fd == -1)
+        return;
+
+    if(getsockopt(a->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+        error = errno;
+    else if(!error && (events & EV_ERROR))
+        error = ECONNRESET;
+
+    if(error) {
+        fprintf(stderr, "connect: %s\n", strerror(error));
+        close_attempt(a);
+
+        /* don't wait for the delay before trying the next one */
+        start_attempt(cn);
+        return;
+    }
+
+    if(!(events & EV_WRITE))
+        return;
+
+    /* the time the handshake took is a round trip to the server */
+    cn->rtt = event_time() - a->started;
+
+    /* the socket is handed over as it is, without its event */
+    int fd = a->fd;
+    del_event(&(a->ev));
+    a->fd = -1;
+    cn->active--;
+
+    finish_connect(cn, fd);
+}
+
+/* the last attempt has had long enough on its own, so try the next address
+ * as well
+ */
+static void handle_delay_timer(void *data) {
+    start_attempt(data);
+}
+
+/* none of the addresses have connected in time */
+static void handle_timeout(void *data) {
+    fprintf(stderr, "connect: timed out\n");
+    finish_connect(data, -1);
+}
+
+/* start connecting to the next address there is, and arrange for the one
+ * after that to be tried if this one hasn't connected soon; fail if there
+ * are no addresses left and none still trying
+ */
+static void start_attempt(Connector *cn) {
+    while(cn->next < cn->naddrs) {
+        struct addrinfo *p = cn->order[cn->next];
+        Attempt *a = cn->attempt + cn->next++;
+        int fd;
+
+        if((fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK
+                        | SOCK_CLOEXEC, p->ai_protocol)) == -1) {
+            perror("socket");
+            continue;
+        }
+
+        if(connect(fd, p->ai_addr, p->ai_addrlen) == -1
+                && errno != EINPROGRESS) {
+            perror("connect");
+            close(fd);
+            continue;
+        }
+
+        if(add_event(&(a->ev), fd, EV_WRITE, handle_attempt_event, a) != 0) {
+            close(fd);
+            continue;
+        }
+
+        a->fd = fd;
+        a->started = event_time();
+        cn->active++;
+
+        if(cn->next < cn->naddrs)
+            add_timer(&(cn->delay), CONNECT_ATTEMPT_DELAY,
+                    handle_delay_timer, cn);
+        return;
+    }
+
+    del_timer(&(cn->delay));
+
+    if(cn->active == 0)
+        finish_connect(cn, -1);
+}
+
+/* start looking up host and connecting to port on it, calling
+ * handle(data, fd) once there is a connected socket (or -1 if there won't
+ * be); return 0 if it has started and -1 on error, in which case handle is
+ * not called
+ */
+int start_connect(Connector *cn, const char *host, const char *port,
+        ConnectHandler handle, void *data) {
+    pthread_attr_t attr;
+    pthread_t thread;
+    Resolve *r;
+    int fds[2];
+    int i, err;
+
+    cn->handle = handle;
+    cn->data = data;
+    cn->addrs = NULL;
+    cn->naddrs = 0;
+    cn->next = 0;
+    cn->active = 0;
+    cn->rtt = -1;
+    for(i = 0; i < CONNECT_MAX_ATTEMPTS; i++) {
+        cn->attempt[i].fd = -1;
+        cn->attempt[i].cn = cn;
+    }
+
+    if(pipe2(fds, O_CLOEXEC | O_NONBLOCK) == -1) {
+        perror("pipe2");
+        cn->resolvefd = -1;
+        return -1;
+    }
+
+    cn->resolvefd = fds[0];
+    if(add_event(&(cn->resolveev), fds[0], EV_READ, handle_resolve_event,
+                cn) != 0) {
+        close(fds[0]);
+        close(fds[1]);
+        cn->resolvefd = -1;
+        return -1;
+    }
+
+    r = malloc(sizeof(Resolve));
+    memset(r, 0, sizeof(Resolve));
+    r->host = strdup(host);
+    r->port = strdup(port);
+    r->fd = fds[1];
+
+    /* nothing waits for the thread; it exits once it has written */
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    err = pthread_create(&thread, &attr, resolve_thread, r);
+    pthread_attr_destroy(&attr);
+
+    if(err) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        close(fds[1]);
+        free_resolve(r);
+        stop_resolve(cn);
+        return -1;
+    }
+
+    add_timer(&(cn->timeout), CONNECT_TIMEOUT, handle_timeout, cn);
+
+    return 0;
+}
@@ -0,0 +1,51 @@
+/* Connection handling for muxirc
+ *
+ * James Stanley 2012
+ */
+
+#ifndef CONNECT_H_INC
+#define CONNECT_H_INC
+
+/* a new address is tried if none of the ones already tried have connected
+ * after this many milliseconds (as suggested by RFC 8305)
+ */
+#define CONNECT_ATTEMPT_DELAY 250
+
+/* give up on all of the addresses if none has connected after this many
+ * milliseconds
+ */
+#define CONNECT_TIMEOUT 30000
+
+/* at most this many of the addresses a name resolves to are tried */
+#define CONNECT_MAX_ATTEMPTS 16
+
+/* called with the connected fd, or -1 if no address could be connected to */
+typedef void(*ConnectHandler)(void *, int);
+
+typedef struct Attempt {
+    int fd;
+    long started;
+    Event ev;
+    struct Connector *cn;
+} Attempt;
+
+typedef struct Connector {
+    ConnectHandler handle;
+    void *data;
+    int resolvefd;
+    Event resolveev;
+    struct addrinfo *addrs;
+    struct addrinfo *order[CONNECT_MAX_ATTEMPTS];
+    int naddrs;
+    int next;
+    Attempt attempt[CONNECT_MAX_ATTEMPTS];
+    int active;
+    Timer delay;
+    Timer timeout;
+    long rtt;
+} Connector;
+
+int start_connect(Connector *cn, const char *host, const char *port,
+        ConnectHandler handle, void *data);
+
+#endif
@@ -0,0 +1,236 @@
+/* Event handling for muxirc
+ *
+ * James Stanley 2012
+ */
+
+#include <sys/epoll.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "event.h"
+
+#define MAX_EVENTS 64
+
+/* every thread that runs an event loop has its own epoll instance, deferred
+ * events and timers, and everything registered with it is only touched by
+ * that thread
+ */
+static __thread int epfd = -1;
+
+/* events that have been deferred until after the current batch of epoll
+ * events has been dispatched
+ */
+static __thread Event *deferred;
+
+/* timers that are waiting to go off, soonest first */
+static __thread Timer *timers;
+
+/* create the epoll instance; return 0 on success and -1 on error */
+int init_events(void) {
+    if((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* register fd with the event loop so that handle(data, events) is called when
+ * any of the given events become ready; notification is edge-triggered, so
+ * the handler must consume everything that is available (i.e. until EAGAIN)
+ * return 0 on success and -1 on error
+ */
+int add_event(Event *ev, int fd, int events, EventHandler handle,
+        void *data) {
+    struct epoll_event e;
+
+    memset(ev, 0, sizeof(Event));
+    ev->fd = fd;
+    ev->handle = handle;
+    ev->data = data;
+
+    memset(&e, 0, sizeof(e));
+    e.events = EPOLLET | EPOLLRDHUP;
+    if(events & EV_READ)
+        e.events |= EPOLLIN;
+    if(events & EV_WRITE)
+        e.events |= EPOLLOUT;
+    e.data.ptr = ev;
+
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &e) == -1) {
+        perror("epoll_ctl");
+        ev->fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* set up ev without an fd, so that it only ever happens when it is deferred
+ * with defer_event
+ */
+void init_event(Event *ev, EventHandler handle, void *data) {
+    memset(ev, 0, sizeof(Event));
+    ev->fd = -1;
+    ev->handle = handle;
+    ev->data = data;
+}
+
+/* unregister ev from the event loop and forget any deferred events for it */
+void del_event(Event *ev) {
+    Event **p;
+
+    if(ev->fd != -1) {
+        /* a non-NULL event pointer is required by pre-2.6.9 kernels */
+        struct epoll_event e;
+        if(epoll_ctl(epfd, EPOLL_CTL_DEL, ev->fd, &e) == -1)
+            perror("epoll_ctl");
+        ev->fd = -1;
+    }
+
+    if(ev->pending) {
+        for(p = &deferred; *p; p = &((*p)->next)) {
+            if(*p == ev) {
+                *p = ev->next;
+                break;
+            }
+        }
+        ev->pending = 0;
+    }
+}
+
+/* arrange for the handler of ev to be called with the given events once the
+ * current batch of events has been dispatched; this is the only way a handler
+ * is called with EV_ERROR, so it is safe to free things from there
+ */
+void defer_event(Event *ev, int events) {
+    if(!ev->handle)
+        return;
+
+    if(!ev->pending) {
+        ev->next = deferred;
+        deferred = ev;
+    }
+
+    ev->pending |= events;
+}
+
+/* return the time in milliseconds on a clock that only goes forwards */
+long event_time(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/* arrange for handle(data) to be called once, ms milliseconds from now; a
+ * timer that is already armed is moved to the new time
+ */
+void add_timer(Timer *t, long ms, TimerHandler handle, void *data) {
+    Timer **p;
+
+    del_timer(t);
+
+    /* a timer re-armed by its own handler mustn't go off again straight away
+     * in the same pass
+     */
+    if(ms < 1)
+        ms = 1;
+
+    t->when = event_time() + ms;
+    t->handle = handle;
+    t->data = data;
+    t->armed = 1;
+
+    for(p = &timers; *p && (*p)->when <= t->when; p = &((*p)->next))
+        ;
+    t->next = *p;
+    *p = t;
+}
+
+/* disarm the timer if it is armed */
+void del_timer(Timer *t) {
+    Timer **p;
+
+    if(!t->armed)
+        return;
+
+    for(p = &timers; *p; p = &((*p)->next)) {
+        if(*p == t) {
+            *p = t->next;
+            break;
+        }
+    }
+    t->armed = 0;
+}
+
+/* wait up to timeout milliseconds (or forever if timeout is -1), or until
+ * the next timer is due, for events and dispatch them, followed by any timers
+ * that are due and then any deferred events; return the number of epoll
+ * events dispatched, or -1 on error
+ */
+int wait_events(int timeout) {
+    struct epoll_event e[MAX_EVENTS];
+    int i, n;
+
+    if(timers) {
+        long until = timers->when - event_time();
+        if(until < 0)
+            until = 0;
+        if(timeout == -1 || until < timeout)
+            timeout = until;
+    }
+
+    if((n = epoll_wait(epfd, e, MAX_EVENTS, timeout)) == -1) {
+        if(errno != EINTR)
+            return -1;
+        n = 0;
+    }
+
+    for(i = 0; i < n; i++) {
+        Event *ev = e[i].data.ptr;
+        int events = 0;
+
+        if(e[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            events |= EV_READ;
+        if(e[i].events & EPOLLOUT)
+            events |= EV_WRITE;
+
+        /* nothing in this batch is freed until the deferred events are run,
+         * so ev is still valid here
+         */
+        ev->handle(ev->data, events);
+
+        if(e[i].events & (EPOLLHUP | EPOLLERR))
+            defer_event(ev, EV_ERROR);
+    }
+
+    /* a timer's handler may re-arm it or disarm others, so take each one off
+     * the list just before it is run
+     */
+    long now = event_time();
+    while(timers && timers->when <= now) {
+        Timer *t = timers;
+
+        timers = t->next;
+        t->armed = 0;
+
+        t->handle(t->data);
+    }
+
+    /* handlers may defer more events, so keep going until there are none */
+    while(deferred) {
+        Event *ev = deferred;
+        int events = ev->pending;
+
+        deferred = ev->next;
+        ev->pending = 0;
+
+        ev->handle(ev->data, events);
+    }
+
+    return n;
+}
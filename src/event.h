@@ -0,0 +1,44 @@
+/* Event handling for muxirc
+ *
+ * James Stanley 2012
+ */
+
+#ifndef EVENT_H_INC
+#define EVENT_H_INC
+
+enum {
+    EV_READ=1, EV_WRITE=2, EV_ERROR=4
+};
+
+typedef void(*EventHandler)(void *, int);
+
+typedef struct Event {
+    int fd;
+    int pending;
+    EventHandler handle;
+    void *data;
+    struct Event *next;
+} Event;
+
+typedef void(*TimerHandler)(void *);
+
+typedef struct Timer {
+    long when;
+    int armed;
+    TimerHandler handle;
+    void *data;
+    struct Timer *next;
+} Timer;
+
+int init_events(void);
+int add_event(Event *ev, int fd, int events, EventHandler handle,
+        void *data);
+void init_event(Event *ev, EventHandler handle, void *data);
+void del_event(Event *ev);
+void defer_event(Event *ev, int events);
+long event_time(void);
+void add_timer(Timer *t, long ms, TimerHandler handle, void *data);
+void del_timer(Timer *t);
+int wait_events(int timeout);
+
+#endif
@@ -11,6 +11,8 @@
 #include <errno.h>
 #include <stdarg.h>
 
+#include "event.h"
+#include "buffer.h"
 #include "socket.h"
 #include "message.h"
 #include "str.h"
@@ -22,111 +24,251 @@ char *command_string[] = {
     "CONNECT", "TRACE", "ADMIN", "INFO", "PRIVMSG", "NOTICE",
     "WHO", "WHOIS", "WHOWAS", "KILL", "PING", "PONG", "ERROR",
     "AWAY", "REHASH", "RESTART", "SUMMON", "USERS", "WALLOPS",
-    "USERHOST", "ISON", "CAP", "MOTD",
-    NULL
+    "USERHOST", "ISON", "CAP", "MOTD", "BATCH", "TAGMSG", "CHATHISTORY",
+    "LUSERS", "ACK", NULL
 };
 
-/* allocate an empty Message */
-Message *new_message(void) {
-    Message *m = malloc(sizeof(Message));
-    memset(m, 0, sizeof(Message));
-    return m;
+/* copy s to *p, advancing *p past the copy, and return the copy */
+static const char *pack_string(char **p, const char *s) {
+    char *copy = strcpy(*p, s);
+    *p += strlen(s) + 1;
+    return copy;
+}
+
+/* return the command whose name is the len characters at s (in any case),
+ * or CMD_INVALID if there is none; rather than comparing s with every
+ * command name, this switches on the length and then the first letter, so
+ * that at most a couple of names are compared
+ */
+int lookup_command(const char *s, size_t len) {
+#define MATCH(cmd) \
+    if(strncasecmp(s, #cmd, len) == 0) \
+        return CMD_##cmd
+
+    switch(len) {
+    case 3:
+        switch(s[0] & ~0x20) {
+        case 'A': MATCH(ACK); break;
+        case 'C': MATCH(CAP); break;
+        case 'W': MATCH(WHO); break;
+        }
+        break;
+    case 4:
+        switch(s[0] & ~0x20) {
+        case 'A': MATCH(AWAY); break;
+        case 'I': MATCH(INFO); MATCH(ISON); break;
+        case 'J': MATCH(JOIN); break;
+        case 'K': MATCH(KICK); MATCH(KILL); break;
+        case 'L': MATCH(LIST); break;
+        case 'M': MATCH(MODE); MATCH(MOTD); break;
+        case 'N': MATCH(NICK); break;
+        case 'O': MATCH(OPER); break;
+        case 'P': MATCH(PASS); MATCH(PART); MATCH(PING); MATCH(PONG); break;
+        case 'Q': MATCH(QUIT); break;
+        case 'T': MATCH(TIME); break;
+        case 'U': MATCH(USER); break;
+        }
+        break;
+    case 5:
+        switch(s[0] & ~0x20) {
+        case 'A': MATCH(ADMIN); break;
+        case 'B': MATCH(BATCH); break;
+        case 'E': MATCH(ERROR); break;
+        case 'L': MATCH(LINKS); break;
+        case 'N': MATCH(NAMES); break;
+        case 'S': MATCH(SQUIT); MATCH(STATS); break;
+        case 'T': MATCH(TOPIC); MATCH(TRACE); break;
+        case 'U': MATCH(USERS); break;
+        case 'W': MATCH(WHOIS); break;
+        }
+        break;
+    case 6:
+        switch(s[0] & ~0x20) {
+        case 'I': MATCH(INVITE); break;
+        case 'L': MATCH(LUSERS); break;
+        case 'N': MATCH(NOTICE); break;
+        case 'R': MATCH(REHASH); break;
+        case 'S': MATCH(SERVER); MATCH(SUMMON); break;
+        case 'T': MATCH(TAGMSG); break;
+        case 'W': MATCH(WHOWAS); break;
+        }
+        break;
+    case 7:
+        switch(s[0] & ~0x20) {
+        case 'C': MATCH(CONNECT); break;
+        case 'P': MATCH(PRIVMSG); break;
+        case 'R': MATCH(RESTART); break;
+        case 'V': MATCH(VERSION); break;
+        case 'W': MATCH(WALLOPS); break;
+        }
+        break;
+    case 8:
+        switch(s[0] & ~0x20) {
+        case 'U': MATCH(USERHOST); break;
+        }
+        break;
+    case 11:
+        switch(s[0] & ~0x20) {
+        case 'C': MATCH(CHATHISTORY); break;
+        }
+        break;
+    }
+
+#undef MATCH
+
+    return CMD_INVALID;
 }
 
-/* allocate and initialise a copy of a Message */
+/* allocate and initialise a copy of a Message as a single block of memory
+ * holding the Message and all of its strings, so that it can outlive the
+ * buffer it was parsed from; free it with free_message
+ */
 Message *copy_message(const Message *m) {
-    Message *copy = new_message();
+    size_t size = sizeof(Message);
+    int i;
 
+    if(m->tags)
+        size += strlen(m->tags) + 1;
     if(m->nick)
-        copy->nick = strdup(m->nick);
+        size += strlen(m->nick) + 1;
     if(m->user)
-        copy->user = strdup(m->user);
+        size += strlen(m->user) + 1;
     if(m->host)
-        copy->host = strdup(m->host);
+        size += strlen(m->host) + 1;
+    for(i = 0; i < m->nparams; i++)
+        size += strlen(m->param[i]) + 1;
+
+    Message *copy = malloc(size);
+    char *p = (char *)(copy + 1);
 
+    memset(copy, 0, sizeof(Message));
     copy->command = m->command;
 
-    int i;
+    if(m->tags)
+        copy->tags = pack_string(&p, m->tags);
+    if(m->nick)
+        copy->nick = pack_string(&p, m->nick);
+    if(m->user)
+        copy->user = pack_string(&p, m->user);
+    if(m->host)
+        copy->host = pack_string(&p, m->host);
     for(i = 0; i < m->nparams; i++)
-        add_message_param(copy, strdup(m->param[i]));
+        copy->param[i] = pack_string(&p, m->param[i]);
+    copy->nparams = m->nparams;
 
     return copy;
 }
 
-/* free the given message and all pointer fields */
+/* free a message returned by copy_message */
 void free_message(Message *m) {
-    free(m->nick);
-    free(m->user);
-    free(m->host);
-    free_message_params(m);
     free(m);
 }
 
-/* free the parameters for the message */
-void free_message_params(Message *m) {
-    int i;
+/* add a parameter to m pointing at s (NOT a copy); return 0 on success and
+ * -1 if m already has as many parameters as it can hold
+ */
+int add_message_param(Message *m, const char *s) {
+    if(m->nparams >= MAX_PARAMS + (m->command == CMD_INVALID))
+        return -1;
 
-    for(i = 0; i < m->nparams; i++)
-        free(m->param[i]);
-    free(m->param);
+    m->param[m->nparams++] = s;
 
-    m->nparams = 0;
-    m->param = NULL;
+    return 0;
 }
 
-/* add a parameter to m containing s (NOT a copy), and return m
- * ** NOTE: this means that calling free_message_params will free s so
- * ** make sure you give a copy of s if that is necessary!
+/* return the value of the tag with the given key, which is *len bytes long
+ * and not nul-terminated, or NULL if the message has no such tag; a tag
+ * without a value has an empty one
  */
-Message *add_message_param(Message *m, char *s) {
-    m->nparams++;
-
-    /* if the new parameter count is a power of two, double the size to
-     * allow more parameters
-     */
-    if((m->nparams & (m->nparams - 1)) == 0)
-        m->param = realloc(m->param, m->nparams * 2 * sizeof(char *));
+const char *message_tag(const Message *m, const char *key, size_t *len) {
+    size_t keylen = strlen(key);
+    const char *p = m->tags;
+
+    while(p && *p) {
+        size_t n = strcspn(p, ";");
+
+        if(n >= keylen && strncmp(p, key, keylen) == 0
+                && (n == keylen || p[keylen] == '=')) {
+            p += keylen + (n > keylen);
+            *len = n - keylen - (n > keylen);
+            return p;
+        }
 
-    m->param[m->nparams - 1] = s;
+        p += n + (p[n] == ';');
+    }
 
-    return m;
+    return NULL;
 }
 
-/* return a Message structure representing the line, or NULL if a parse error
- * occurs.
+/* parse the nul-terminated line into m, which will point into line rather
+ * than holding copies (line is modified to nul-terminate each part); return 0
+ * on success and non-zero if a parse error occurs
  */
-Message *parse_message(const char *line) {
-    const char *p = line;
-    Message *m = new_message();
+int parse_message(Message *m, char *line) {
+    char *p = line;
+
+    memset(m, 0, sizeof(Message));
+
+    /* ignore empty messages */
+    if(*line == '\0' || *line == '\r' || *line == '\n')
+        return -1;
 
-    /* accept empty messages */
-    if(*line == '\r' || *line == '\n')
-        return m;
+    if(parse_tags(&p, m) != 0)
+        return -1;
 
     if(parse_prefix(&p, m) != 0)
-        goto cleanup;
+        return -1;
 
     if(parse_command(&p, m) != 0)
-        goto cleanup;
+        return -1;
 
     if(parse_params(&p, m) != 0)
-        goto cleanup;
+        return -1;
 
     /* if this has not used up all of the line, fail */
     if(*p)
-        goto cleanup;
+        return -1;
 
-    return m;
+    return 0;
+}
 
-cleanup:
-    free_message(m);
-    return NULL;
+/* nul-terminate the n characters at *line, updating *line to point past the
+ * character that was overwritten (unless it was the end of the line), and
+ * return the character that was overwritten
+ */
+static char terminate(char **line, size_t n) {
+    char c = (*line)[n];
+
+    (*line)[n] = '\0';
+    *line += n + (c != '\0');
+
+    return c;
+}
+
+/* parse IRCv3 tags from line and stick them in m, updating line to point to
+ * the next text; return 0 on success and non-zero on failure
+ */
+int parse_tags(char **line, Message *m) {
+    /* tags are optional */
+    if(**line != '@')
+        return 0;
+
+    /* skip the @ */
+    (*line)++;
+
+    m->tags = *line;
+    terminate(line, strcspn(*line, " "));
+
+    skip_space(line);
+    return 0;
 }
 
 /* parse a prefix from line and stick it in m, updating line to point to the
  * next text; return 0 on success and non-zero on failure
  */
-int parse_prefix(const char **line, Message *m) {
+int parse_prefix(char **line, Message *m) {
+    char sep;
+
     /* prefixes are optional */
     if(**line != ':')
         return 0;
@@ -141,22 +283,19 @@ int parse_prefix(const char **line, Message *m) {
     /* skip the colon */
     (*line)++;
 
-    int nicklen = strcspn(*line, "!@ ");
-    m->nick = strprefix(*line, nicklen);
-    *line += nicklen + 1;
+    m->nick = *line;
+    sep = terminate(line, strcspn(*line, "!@ "));
 
-    /* copy user if there is one */
-    if(*(*line-1) == '!') {
-        int userlen = strcspn(*line, "@ ");
-        m->user = strprefix(*line, userlen);
-        *line += userlen + 1;
+    /* user if there is one */
+    if(sep == '!') {
+        m->user = *line;
+        sep = terminate(line, strcspn(*line, "@ "));
     }
 
-    /* copy the host if there is one */
-    if(*(*line-1) == '@') {
-        int hostlen = strcspn(*line, " ");
-        m->host = strprefix(*line, hostlen);
-        *line += hostlen + 1;
+    /* the host if there is one */
+    if(sep == '@') {
+        m->host = *line;
+        terminate(line, strcspn(*line, " "));
     }
 
     skip_space(line);
@@ -166,33 +305,27 @@ int parse_prefix(const char **line, Message *m) {
 /* parse a command from line and stick it in m, updating line to point to the
  * next text; return 0 on success and non-zero on failure
  */
-int parse_command(const char **line, Message *m) {
+int parse_command(char **line, Message *m) {
     if(isdigit(**line)) {
         /* numeric command */
         if(!isdigit(*(*line + 1)) || !isdigit(*(*line + 2))
                 || *(*line + 3) != ' ')
             return -1;
-        
+
         m->command = atoi(*line);
         *line += 3;
     } else {
         /* textual command */
-        int i;
         int commandlen = strcspn(*line, " ");
-        for(i = 0; command_string[i]; i++) {
-            if(commandlen == strlen(command_string[i])
-                    && strncasecmp(*line, command_string[i], commandlen) == 0)
-                break;
-        }
 
-        if(command_string[i]) {
-            m->command = FIRST_CMD + i;
+        m->command = lookup_command(*line, commandlen);
+
+        if(m->command != CMD_INVALID) {
+            *line += commandlen;
         } else {
-            m->command = CMD_INVALID;
-            add_message_param(m, strprefix(*line, commandlen));
+            add_message_param(m, *line);
+            terminate(line, commandlen);
         }
-
-        *line += commandlen;
     }
 
     skip_space(line);
@@ -203,96 +336,191 @@ int parse_command(const char **line, Message *m) {
  * to the next text (end of line); return 0 on success and non-zero on
  * failure
  */
-int parse_params(const char **line, Message *m) {
+int parse_params(char **line, Message *m) {
+    int maxparams = MAX_PARAMS + (m->command == CMD_INVALID);
+
     while(**line && **line != '\r' && **line != '\n') {
         int paramlen;
 
-        /* consume to end of line if this parameter begins with ":" */
+        /* consume to end of line if this parameter begins with ":", or if it
+         * is the last one there is room for
+         */
         if(**line == ':')
             paramlen = strcspn(++(*line), "\r\n");
+        else if(m->nparams == maxparams - 1)
+            paramlen = strcspn(*line, "\r\n");
         else
             paramlen = strcspn(*line, " \r\n");
 
-        add_message_param(m, strprefix(*line, paramlen));
+        add_message_param(m, *line);
+
+        /* an endline is left alone so that it can be eaten below */
+        if((*line)[paramlen] == ' ')
+            terminate(line, paramlen);
+        else
+            *line += paramlen;
 
-        *line += paramlen;
         skip_space(line);
     }
 
     /* eat the \r\n */
     while(**line == '\r' || **line == '\n')
-        (*line)++;
+        *(*line)++ = '\0';
 
     return 0;
 }
 
 /* skip over space by advancing the pointer to the next non-space character. */
-void skip_space(const char **p) {
+void skip_space(char **p) {
     while(**p == ' ')
         (*p)++;
 }
 
-/* allocate a 513-byte buffer containing the stringified message, \r\n and a
- * nul byte, storing the full length of text (including \r\n) in *length if
- * length is not NULL
+/* return the size of the buffer needed by write_message: MESSAGE_SIZE for
+ * the message and a nul byte, and however much the tags need (they don't
+ * count towards the 512 bytes)
+ */
+size_t message_size(const Message *m) {
+    return MESSAGE_SIZE + (m->tags ? strlen(m->tags) + 2 : 0);
+}
+
+/* copy as much of the nul-terminated str to *p as will fit before end,
+ * advancing *p past it
  */
-char *strmessage(const Message *m, size_t *length) {
-    char command[16];
-    char *line = malloc(513);
-    char *endptr = line;
-
-    if(m->nick) {
-        strappend(line, &endptr, 511, ":");
-        strappend(line, &endptr, 511, m->nick);
-        if(m->user) {
-            strappend(line, &endptr, 511, "!");
-            strappend(line, &endptr, 511, m->user);
+static void put(char **p, const char *end, const char *str) {
+    size_t n = strlen(str);
+
+    if(n > (size_t)(end - *p))
+        n = end - *p;
+
+    memcpy(*p, str, n);
+    *p += n;
+}
+
+/* write the prefix (if there is a nick) and the command to *p, advancing it */
+static void put_start(char **p, const char *end, const char *nick,
+        const char *user, const char *host, int command) {
+    if(nick) {
+        put(p, end, ":");
+        put(p, end, nick);
+        if(user) {
+            put(p, end, "!");
+            put(p, end, user);
         }
-        if(m->host) {
-            strappend(line, &endptr, 511, "@");
-            strappend(line, &endptr, 511, m->host);
+        if(host) {
+            put(p, end, "@");
+            put(p, end, host);
         }
-
-        strappend(line, &endptr, 511, " ");
+        put(p, end, " ");
     }
 
-    if(m->command < FIRST_CMD || m->command >= NCOMMANDS) {
-        if(m->command == CMD_INVALID) {
-            strappend(line, &endptr, 511, m->param[0]);
-        } else {
-            snprintf(command, 8, "%03d", m->command);
-            strappend(line, &endptr, 511, command);
-        }
-    } else {
-        strappend(line, &endptr, 511, command_string[m->command - FIRST_CMD]);
+    if(command >= FIRST_CMD && command < NCOMMANDS) {
+        put(p, end, command_string[command - FIRST_CMD]);
+    } else if(command != CMD_INVALID) {
+        char num[4] = {
+            '0' + command / 100 % 10, '0' + command / 10 % 10,
+            '0' + command % 10, '\0'
+        };
+        put(p, end, num);
     }
+}
 
+/* write a parameter to *p, advancing it; the last one needs a ':' if it
+ * starts with one or has spaces in it
+ */
+static void put_param(char **p, const char *end, const char *param,
+        int last) {
+    put(p, end, " ");
+    if(last && (param[0] == ':' || strchr(param, ' ')))
+        put(p, end, ":");
+    put(p, end, param);
+}
+
+/* write \r\n and a nul byte to p, which is at most 510 bytes past the start
+ * of the line, and return the length of the line
+ */
+static size_t put_end(char *line, char *p) {
+    memcpy(p, "\r\n", 3);
+    return p + 2 - line;
+}
+
+/* write the stringified message, \r\n and a nul byte into the buffer at
+ * line, which must be message_size bytes, returning the full length of text
+ * (including \r\n); anything that doesn't fit in 512 bytes is cut off
+ */
+size_t write_message(const Message *m, char *line) {
+    char *p = line;
     int i;
-    for(i = (m->command == CMD_INVALID); i < m->nparams; i++) {
-        strappend(line, &endptr, 511, " ");
-        if(i == m->nparams-1 && (m->param[i][0] == ':'
-                    || strchr(m->param[i], ' ')))
-            strappend(line, &endptr, 511, ":");
-        strappend(line, &endptr, 511, m->param[i]);
+
+    if(m->tags) {
+        size_t taglen = strlen(m->tags);
+        *p++ = '@';
+        memcpy(p, m->tags, taglen);
+        p += taglen;
+        *p++ = ' ';
     }
 
-    strappend(line, &endptr, 513, "\r\n");
+    const char *end = p + MESSAGE_SIZE - 3;
+
+    put_start(&p, end, m->nick, m->user, m->host, m->command);
 
-    if(length)
-        *length = endptr - line;
+    /* an unrecognised command keeps its name in the first parameter */
+    i = 0;
+    if(m->command == CMD_INVALID && m->nparams > 0)
+        put(&p, end, m->param[i++]);
 
-    return line;
+    for(; i < m->nparams; i++)
+        put_param(&p, end, m->param[i], i == m->nparams - 1);
+
+    return put_end(line, p);
 }
 
-/* send the given message to the given socket */
+/* write a message with the given prefix, command and NULL-terminated list of
+ * parameters into the buffer at line, which must be MESSAGE_SIZE bytes, in
+ * the same way as write_message, but without needing a Message
+ */
+size_t write_messagev(char *line, const char *nick, const char *user,
+        const char *host, int command, va_list argp) {
+    const char *end = line + MESSAGE_SIZE - 3;
+    const char *param, *next;
+    char *p = line;
+
+    put_start(&p, end, nick, user, host, command);
+
+    param = va_arg(argp, const char *);
+    if(command == CMD_INVALID && param) {
+        put(&p, end, param);
+        param = va_arg(argp, const char *);
+    }
+
+    /* look one ahead, as the last parameter may need a ':' */
+    for(; param; param = next) {
+        next = va_arg(argp, const char *);
+        put_param(&p, end, param, !next);
+    }
+
+    return put_end(line, p);
+}
+
+/* return a new buffer containing the stringified message and \r\n, suitable
+ * for sharing between the output queues of several sockets
+ */
+Buffer *message_buffer(const Message *m) {
+    Buffer *buf = new_buffer(message_size(m));
+    buf->len = write_message(m, buf->data);
+    return buf;
+}
+
+/* send the given message to the given socket, writing it straight into the
+ * socket's output queue
+ */
 int send_socket_message(Socket *sock, const Message *m) {
-    size_t msglen;
-    char *strmsg = strmessage(m, &msglen);
+    char *line = reserve_socket(sock, message_size(m));
 
-    int r = send_socket_string(sock, strmsg, msglen);
+    if(!line)
+        return -1;
 
-    free(strmsg);
-    return r;
+    return commit_socket(sock, line, write_message(m, line));
 }
 
 /* send a message to the given socket, in the form:
@@ -301,61 +529,102 @@ int send_socket_message(Socket *sock, const Message *m) {
 int send_socket_messagev(Socket *sock, const char *nick, const char *user,
         const char *host, int command, ...) {
     va_list argp;
-    Message *m = new_message();
+    char *line = reserve_socket(sock, MESSAGE_SIZE);
+    size_t len;
 
-    if(nick)
-        m->nick = strdup(nick);
-    if(user)
-        m->user = strdup(user);
-    if(host)
-        m->host = strdup(host);
-    m->command = command;
+    if(!line)
+        return -1;
 
     va_start(argp, command);
+    len = write_messagev(line, nick, user, host, command, argp);
+    va_end(argp);
 
-    char *s;
-    while(1) {
-        s = va_arg(argp, char *);
-        if(!s)
-            break;
+    return commit_socket(sock, line, len);
+}
 
-        add_message_param(m, strdup(s));
+/* return the command of the nul-terminated line without parsing (or
+ * modifying) the rest of it, pointing *body at whatever follows the tags;
+ * return -1 if there is no valid command
+ */
+int peek_command(const char *line, const char **body) {
+    const char *p = line;
+    size_t n;
+
+    if(*p == '@') {
+        p += strcspn(p, " ");
+        while(*p == ' ')
+            p++;
     }
+    *body = p;
 
-    va_end(argp);
+    if(*p == ':') {
+        p += strcspn(p, " ");
+        while(*p == ' ')
+            p++;
+    }
 
-    int r = send_socket_message(sock, m);
-    free_message(m);
+    n = strcspn(p, " ");
+    if(n == 0)
+        return -1;
 
-    return r;
+    /* numerics are exactly three digits and always have parameters */
+    if(isdigit(*p))
+        return n == 3 && isdigit(p[1]) && isdigit(p[2]) && p[3] == ' '
+            ? atoi(p) : -1;
+
+    return lookup_command(p, n);
 }
 
-/* handle messages from the string by parsing them and passing them to the
- * handler function, and removing all data that was handled (moving anything
- * left over to the start of buf)
+/* handle messages from the socket buffer by parsing them and passing them to
+ * the handler function, and removing all data that was handled (moving
+ * anything left over to the start of buf); if raw is not NULL, each line is
+ * offered to it first, along with its length, and only parsed and handled
+ * if raw returns non-zero
  */
-void handle_messages(Socket *sock, GenericMessageHandler handle, void *data) {
-    char *p, *str = sock->buf;
-
-    /* while there are endlines, handle data */
-    while((p = strpbrk(str, "\r\n")) && !sock->error) {
-        char c = *p;
-        *p = '\0';
-
-        /* parse and handle the message */
-        Message *m = parse_message(str);
-        if(m) {
-            handle(data, m);
-            free_message(m);
-        }
+void handle_raw_messages(Socket *sock, RawMessageHandler raw,
+        GenericMessageHandler handle, void *data) {
+    LineSpan line[64];
+    size_t off = 0, used;
+    int i, n;
+
+    /* find the lines a batch at a time, so that the whole buffer is only
+     * scanned once however many lines are in it
+     */
+    do {
+        n = split_lines(sock->buf + off, sock->bytes - off, line, 64, &used);
 
-        *p = c;
+        for(i = 0; i < n && !sock->error; i++) {
+            char *str = sock->buf + off + line[i].start;
 
-        /* advance past the endline characters */
-        str = p + strspn(p, "\r\n");
-    }
+            /* lines containing nul bytes can't be valid, so drop them
+             * rather than letting them truncate anything
+             */
+            if(memchr(str, '\0', line[i].len))
+                continue;
+
+            /* overwrite the endline so that the line is nul-terminated */
+            str[line[i].len] = '\0';
+
+            if(raw && raw(data, str, line[i].len) == 0)
+                continue;
+
+            /* parse and handle the message */
+            Message m;
+            if(parse_message(&m, str) == 0)
+                handle(data, &m);
+        }
+
+        off += used;
+    } while(n == 64 && !sock->error);
 
     /* move any left-over data to the start of the buffer */
-    sock->bytes -= str - sock->buf;
-    memmove(sock->buf, str, sock->bytes + 1);
+    sock->bytes -= off;
+    memmove(sock->buf, sock->buf + off, sock->bytes + 1);
+}
+
+/* handle messages from the socket buffer as handle_raw_messages does, parsing
+ * every line
+ */
+void handle_messages(Socket *sock, GenericMessageHandler handle, void *data) {
+    handle_raw_messages(sock, NULL, handle, data);
 }
@@ -6,22 +6,50 @@
 #ifndef MESSAGE_H_INC
 #define MESSAGE_H_INC
 
+/* the most parameters a message can have (RFC 1459) */
+#define MAX_PARAMS 15
+
+/* the most bytes a message without tags takes (512), plus a nul byte */
+#define MESSAGE_SIZE 513
+
+/* a parsed message; the strings normally point into the buffer the message
+ * was parsed from, so a Message must be copied with copy_message if it is to
+ * be kept around
+ */
 typedef struct Message {
-    char *nick, *user, *host;
+    /* IRCv3 tags, without the leading '@' */
+    const char *tags;
+    const char *nick, *user, *host;
     int command;
-    char **param;
+    /* one extra slot for the name of an unrecognised (CMD_INVALID) command */
+    const char *param[MAX_PARAMS + 1];
     int nparams;
 } Message;
 
 typedef int(*GenericMessageHandler)(void *, const Message *);
+typedef int(*RawMessageHandler)(void *, char *, size_t);
 
 enum {
     CMD_NONE=0,
     RPL_WELCOME=1, RPL_YOURHOST, RPL_CREATED, RPL_MYINFO, RPL_ISUPPORT,
-    RPL_TOPIC=332, RPL_TOPICWHOTIME, RPL_MOTD=372, RPL_MOTDSTART=375,
-    RPL_ENDOFMOTD,
+    RPL_UMODEIS=221, RPL_STATSCONN=250, RPL_LUSERCLIENT, RPL_LUSEROP,
+    RPL_LUSERUNKNOWN, RPL_LUSERCHANNELS, RPL_LUSERME, RPL_ADMINME,
+    RPL_ADMINLOC1, RPL_ADMINLOC2, RPL_ADMINEMAIL, RPL_TRYAGAIN=263,
+    RPL_LOCALUSERS=265, RPL_GLOBALUSERS, RPL_WHOISCERTFP=276, RPL_AWAY=301,
+    RPL_WHOISREGNICK=307, RPL_WHOISUSER=311, RPL_WHOISSERVER,
+    RPL_WHOISOPERATOR, RPL_ENDOFWHO=315, RPL_WHOISIDLE=317, RPL_ENDOFWHOIS,
+    RPL_WHOISCHANNELS, RPL_WHOISSPECIAL, RPL_LISTSTART, RPL_LIST,
+    RPL_LISTEND, RPL_CHANNELMODEIS, RPL_CREATIONTIME=329, RPL_WHOISACCOUNT,
+    RPL_NOTOPIC, RPL_TOPIC, RPL_TOPICWHOTIME, RPL_WHOISACTUALLY=338,
+    RPL_VERSION=351, RPL_WHOREPLY, RPL_NAMREPLY, RPL_WHOSPCRPL,
+    RPL_ENDOFNAMES=366, RPL_INFO=371, RPL_MOTD, RPL_INFOSTART, RPL_ENDOFINFO,
+    RPL_MOTDSTART, RPL_ENDOFMOTD, RPL_WHOISHOST=378, RPL_WHOISMODES,
+    ERR_NOSUCHNICK=401, ERR_NOSUCHSERVER, ERR_NOSUCHCHANNEL,
+    ERR_TOOMANYCHANNELS=405, ERR_UNKNOWNCOMMAND=421, ERR_NOMOTD, ERR_NOADMININFO,
     ERR_NICKNAMEINUSE=433, ERR_NOTONCHANNEL=442, ERR_NEEDMOREPARAMS=461,
-    ERR_PASSWDMISMATCH=464,
+    ERR_PASSWDMISMATCH=464, ERR_CHANNELISFULL=471, ERR_INVITEONLYCHAN=473,
+    ERR_BANNEDFROMCHAN, ERR_BADCHANNELKEY, ERR_NEEDREGGEDNICK=477,
+    RPL_WHOISSECURE=671,
     CMD_INVALID=1000,
     FIRST_CMD=1001,
     CMD_PASS=1001, CMD_NICK, CMD_USER, CMD_SERVER, CMD_OPER, CMD_QUIT,
@@ -30,26 +58,35 @@ enum {
     CMD_CONNECT, CMD_TRACE, CMD_ADMIN, CMD_INFO, CMD_PRIVMSG, CMD_NOTICE,
     CMD_WHO, CMD_WHOIS, CMD_WHOWAS, CMD_KILL, CMD_PING, CMD_PONG, CMD_ERROR,
     CMD_AWAY, CMD_REHASH, CMD_RESTART, CMD_SUMMON, CMD_USERS, CMD_WALLOPS,
-    CMD_USERHOST, CMD_ISON, CMD_CAP, CMD_MOTD,
+    CMD_USERHOST, CMD_ISON, CMD_CAP, CMD_MOTD, CMD_BATCH, CMD_TAGMSG,
+    CMD_CHATHISTORY, CMD_LUSERS, CMD_ACK,
     NCOMMANDS
 };
 
 extern char *command_string[];
 
-Message *new_message(void);
+int lookup_command(const char *s, size_t len);
 Message *copy_message(const Message *m);
 void free_message(Message *m);
-void free_message_params(Message *m);
-Message *add_message_param(Message *m, char *s);
-Message *parse_message(const char *line);
-int parse_prefix(const char **line, Message *m);
-int parse_command(const char **line, Message *m);
-int parse_params(const char **line, Message *m);
-void skip_space(const char **p);
-char *strmessage(const Message *m, size_t *length);
+int add_message_param(Message *m, const char *s);
+const char *message_tag(const Message *m, const char *key, size_t *len);
+int parse_message(Message *m, char *line);
+int parse_tags(char **line, Message *m);
+int parse_prefix(char **line, Message *m);
+int parse_command(char **line, Message *m);
+int parse_params(char **line, Message *m);
+void skip_space(char **p);
+size_t message_size(const Message *m);
+size_t write_message(const Message *m, char *line);
+size_t write_messagev(char *line, const char *nick, const char *user,
+        const char *host, int command, va_list argp);
+Buffer *message_buffer(const Message *m);
 int send_socket_message(Socket *sock, const Message *m);
 int send_socket_messagev(Socket *sock, const char *nick, const char *user,
         const char *host, int command, ...);
+int peek_command(const char *line, const char **body);
+void handle_raw_messages(Socket *sock, RawMessageHandler raw,
+        GenericMessageHandler handle, void *data);
 void handle_messages(Socket *sock, GenericMessageHandler handle, void *data);
 
 #endif
@@ -3,168 +3,311 @@
  * James Stanley 2012
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
-#include <poll.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <time.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
 
+#include "event.h"
+#include "buffer.h"
+#include "table.h"
+#include "slab.h"
 #include "socket.h"
+#include "worker.h"
+#include "connect.h"
+#include "pool.h"
+#include "sched.h"
 #include "message.h"
 #include "client.h"
+#include "config.h"
 #include "server.h"
+#include "request.h"
+
+/* an event-loop thread and the networks that it looks after; nothing that
+ * belongs to one shard is touched by any other thread, except that the main
+ * thread writes to wakefd to ask for statistics and the shard's workers are
+ * only spoken to through their rings
+ */
+typedef struct Shard {
+    pthread_t thread;
+    const Network **network;
+    Server *server;
+    int nservers;
+    int nworkers;
+    Workers workers;
+    int wakefd[2];
+    Event wakeev;
+} Shard;
+
+/* send QUIT to the server and ERROR to all of the clients */
+static void quit_server(Server *s, const char *text) {
+    Message m;
+
+    /* we are going away, so there is no need to wait for flood control */
+    if(s->sock && s->sock->fd != -1) {
+        send_socket_messagev(s->sock, NULL, NULL, NULL, CMD_QUIT, text, NULL);
+        flush_socket(s->sock);
+        close(s->sock->fd);
+        s->sock->fd = -1;
+    }
+
+    memset(&m, 0, sizeof(Message));
+    m.command = CMD_ERROR;
+    add_message_param(&m, text);
 
-/* something terrible has happened; write a message to the console, quit the
- * server, and inform all of the clients
+    Buffer *buf = message_buffer(&m);
+
+    Client *c;
+    int h = 0;
+    while((c = next_client(s, &h))) {
+        send_socket_buffer(&c->sock, buf);
+        flush_socket(&c->sock);
+    }
+
+    free_buffer(buf);
+}
+
+/* something terrible has happened to the shard; write a message to the
+ * console, quit its servers, inform all of their clients, and exit
  */
-void fatal(Server *s, const char *prefix, const char *msg) {
-    Message *m;
+static void fatal(Shard *sh, const char *prefix, const char *msg) {
     char text[512];
+    int i;
 
     fprintf(stderr, "%s: %s\n", prefix, msg);
 
     snprintf(text, 512, "%s: %s", prefix, msg);
 
-    send_socket_messagev(s->sock, NULL, NULL, NULL, CMD_QUIT, text, NULL);
-    close(s->sock->fd);
-    s->sock->fd = -1;
+    for(i = 0; i < sh->nservers; i++)
+        quit_server(sh->server + i, text);
+
+    exit(1);
+}
 
-    m = new_message();
-    m->command = CMD_ERROR;
-    add_message_param(m, strdup(text));
+/* handle activity on the listening socket */
+static void handle_listen_event(void *data, int events) {
+    Server *s = data;
 
-    size_t msglen;
-    char *strmsg = strmessage(m, &msglen);
+    if(events & EV_ERROR) {
+        fprintf(stderr, "muxirc: error on listening socket for %s\n",
+                s->name);
+        quit_server(s, "muxirc: Help! POLLHUP on listening socket! What "
+                "does that mean? What is a socket???");
+        exit(1);
+    } else if(events & EV_READ) {
+        handle_new_connection(s);
+    }
+}
 
-    Client *c;
-    for(c = s->client_list; c; c = c->next)
-        send_socket_string(c->sock, strmsg, msglen);
+/* the main thread has asked for statistics; write them for each of the
+ * shard's servers without interleaving them with other shards' output
+ */
+static void handle_wake_event(void *data, int events) {
+    Shard *sh = data;
+    char buf[64];
+    int i;
 
-    free(strmsg);
-    free_message(m);
+    while(read(sh->wakefd[0], buf, sizeof(buf)) > 0)
+        ;
 
-    exit(1);
+    flockfile(stderr);
+    for(i = 0; i < sh->nservers; i++)
+        dump_server_stats(sh->server + i);
+    funlockfile(stderr);
 }
 
-int main() {
-    Server serverstate;
+/* run the event loop for the shard's networks */
+static void *run_shard(void *data) {
+    Shard *sh = data;
+    int i;
 
-    signal(SIGPIPE, SIG_IGN);
+    if(init_events() != 0)
+        exit(1);
 
-    srand(time(NULL) ^ getpid());
+    if(sh->nworkers && start_workers(&(sh->workers), sh->nworkers,
+                handle_client_job) != 0)
+        exit(1);
 
-    init_client_handlers();
-    init_server_handlers();
+    for(i = 0; i < sh->nservers; i++) {
+        Server *s = sh->server + i;
+
+        irc_connect(s, sh->network[i]);
+        if(sh->nworkers)
+            s->workers = &(sh->workers);
+
+        /* clients are registered with the event loop as they connect, and
+         * the server connection each time it is made, so only the listening
+         * socket needs adding here
+         */
+        if(add_event(&(s->listenev), s->listenfd, EV_READ,
+                    handle_listen_event, s) != 0)
+            exit(1);
+    }
 
-    /* TODO: take these from arguments */
-    irc_connect(&serverstate, "irc.freenode.net", "6667", NULL, "muxirc",
-            "IRC Multiplexer", "10000", "password");
+    if(add_event(&(sh->wakeev), sh->wakefd[0], EV_READ, handle_wake_event,
+                sh) != 0)
+        exit(1);
 
     while(1) {
-        struct pollfd fd[16];
-        Client *client[16];
-        int i = 0;
-
-        /* fd[0] - connection to server */
-        fd[i].fd = serverstate.sock->fd;
-        fd[i].events = POLLIN;
-        fd[i].revents = 0;
-        i++;
-        /* fd[1] - listening socket */
-        fd[i].fd = serverstate.listenfd;
-        fd[i].events = POLLIN;
-        fd[i].revents = 0;
-        i++;
-        /* fd[2..] - connections to clients */
-        Client *c;
-        for(c = serverstate.client_list; c; c = c->next) {
-            fd[i].fd = c->sock->fd;
-            fd[i].events = POLLIN;
-            fd[i].revents = 0;
-            client[i] = c;
-            i++;
-            if(i >= 16) {
-                /* TODO: make this not happen (dynamically resize fd[]) */
-                fprintf(stderr, "warning: excessively many clients; "
-                        "ignoring some!\n");
-                break;
-            }
+        if(wait_events(-1) == -1)
+            fatal(sh, "muxirc: epoll_wait", strerror(errno));
+    }
+
+    return NULL;
+}
+
+/* print usage information and exit */
+static void usage(void) {
+    fprintf(stderr,
+        "usage: muxirc [-s servers] [-p port] [-l listenport] [-k password]\n"
+        "              [-C configfile] [-t threads] [-w workers]\n"
+        "              [-b maxbuf] [-c maxcache] [-f penalty,window]\n"
+        "\n"
+        "  -s servers     comma-separated IRC servers to choose between, each\n"
+        "                 host, host:port or [host]:port (irc.freenode.net)\n"
+        "  -p port        port to connect to on servers without one (6667)\n"
+        "  -l listenport  port to listen for clients on (10000)\n"
+        "  -k password    password clients must give (password)\n"
+        "  -C configfile  read the networks to connect to from configfile\n"
+        "                 instead of -s, -p, -l and -k; see config.c\n"
+        "  -t threads     number of event-loop threads to share the networks\n"
+        "                 between (1)\n"
+        "  -w workers     number of threads per event-loop thread to read\n"
+        "                 from and write to clients (0: the event-loop\n"
+        "                 thread does it)\n"
+        "  -b maxbuf      longest line accepted from the server or a client,\n"
+        "                 in bytes (%zu)\n"
+        "  -c maxcache    most memory to use for cached replies to MOTD, LIST\n"
+        "                 etc., in bytes (%zu)\n"
+        "  -f penalty,window\n"
+        "                 flood control: each line sent to the server costs\n"
+        "                 penalty ms, and at most window ms may be used up at\n"
+        "                 once (%ld,%ld)\n", socket_buffer_limit, cache_budget,
+        flood_penalty, flood_window);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    Config config;
+    Network *net = NULL;
+    const char *configfile = NULL;
+    int nthreads = 0, nworkers = -1;
+    Shard *shard;
+    int nshards;
+    sigset_t sigs;
+    int opt, sig, i, err;
+
+    init_config(&config);
+
+    /* without a config file, the command line describes a single network */
+    while((opt = getopt(argc, argv, "C:t:w:s:p:l:k:b:c:f:")) != -1) {
+        if(strchr("spkl", opt) && !net)
+            net = add_network(&config, "default");
+
+        switch(opt) {
+        case 'C': configfile = optarg; break;
+        case 't':
+            if((nthreads = atoi(optarg)) < 1)
+                usage();
+            break;
+        case 'w':
+            if((nworkers = atoi(optarg)) < 0)
+                usage();
+            break;
+        case 's': free(net->servers); net->servers = strdup(optarg); break;
+        case 'p': free(net->port); net->port = strdup(optarg); break;
+        case 'l':
+            free(net->listenport);
+            net->listenport = strdup(optarg);
+            break;
+        case 'k': free(net->pass); net->pass = strdup(optarg); break;
+        case 'b':
+            socket_buffer_limit = strtoul(optarg, NULL, 10);
+            if(socket_buffer_limit < 514)
+                usage();
+            break;
+        case 'c': cache_budget = strtoul(optarg, NULL, 10); break;
+        case 'f':
+            if(sscanf(optarg, "%ld,%ld", &flood_penalty, &flood_window) != 2
+                    || flood_penalty < 0 || flood_window < flood_penalty)
+                usage();
+            break;
+        default: usage();
         }
+    }
 
-        printf("Polling %d fds\n", i);
-
-        int n = poll(fd, i, -1);
-        usleep(50000);
-
-        if(n == -1) {
-            fatal(&serverstate, "muxirc: poll", strerror(errno));
-        } else if(n == 0) {
-            fatal(&serverstate, "muxirc: poll", "unexpected timeout");
-        } else {
-            /* data/disconnection from server */
-            if(fd[0].revents & POLLIN)
-                handle_server_data(&serverstate);
-            if(fd[0].revents & POLLHUP)
-                fatal(&serverstate, "muxirc", "upstream disconnect (hup)");
-
-            /* connection to listening socket */
-            if(fd[1].revents & POLLIN)
-                handle_new_connection(&serverstate);
-            if(fd[1].revents & POLLHUP)
-                fatal(&serverstate, "muxirc", "Help! POLLHUP on listening "
-                        "socket! What does that mean? What is a socket???");
-
-            /* data/disconnections from clients */
-            int j;
-            for(j = 2; j < i; j++) {
-                if(fd[j].revents & POLLIN)
-                    handle_client_data(client[j]);
-                if(fd[j].revents & POLLHUP)
-                    disconnect_client(client[j]);
-            }
+    if(configfile) {
+        if(net) {
+            fprintf(stderr, "muxirc: -s, -p, -l and -k can't be used with "
+                    "-C\n");
+            usage();
         }
+        if(read_config(&config, configfile) != 0)
+            exit(1);
+    } else if(!net) {
+        add_network(&config, "default");
+    }
+
+    if(nthreads)
+        config.nthreads = nthreads;
+    if(nworkers >= 0)
+        config.nworkers = nworkers;
 
-        /* check server for errors */
-        if(serverstate.sock->error)
-            fatal(&serverstate, "muxirc", "upstream disconnect (error)");
+    signal(SIGPIPE, SIG_IGN);
+
+    /* statistics are asked for with SIGUSR1, which only the main thread
+     * waits for; it is blocked before the shards are started so that they
+     * inherit the mask
+     */
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
 
-        /* check clients for errors */
-        Client *c_next;
-        for(c = serverstate.client_list; c; c = c_next) {
-            c_next = c->next;
+    srand(time(NULL) ^ getpid());
 
-            if(c->sock->error)
-                disconnect_client(c);
+    init_client_handlers();
+    init_server_handlers();
+
+    /* the networks are dealt out between the shards in turn */
+    nshards = config.nthreads < config.nnetworks ? config.nthreads
+        : config.nnetworks;
+    shard = calloc(nshards, sizeof(Shard));
+    for(i = 0; i < nshards; i++) {
+        shard[i].network = malloc(config.nnetworks * sizeof(Network *));
+        shard[i].server = calloc(config.nnetworks, sizeof(Server));
+        shard[i].nworkers = config.nworkers;
+        if(pipe2(shard[i].wakefd, O_NONBLOCK | O_CLOEXEC) == -1) {
+            perror("pipe2");
+            exit(1);
         }
+    }
+    for(i = 0; i < config.nnetworks; i++) {
+        Shard *sh = shard + i % nshards;
+        sh->network[sh->nservers++] = config.network + i;
+    }
 
-        /* if the server isn't busy reading a motd and some clients want one,
-         * request one and update the server motd state
-         */
-        /* TODO: what happens to a client who makes 2 requests for MOTD before
-         * the first one is done? he should get it sent twice; this is more
-         * important for things like TOPIC and NAMES
-         * need to cache the MOTD replies as they are rate-limited (on
-         * freenode at least)
-         * this whole system needs to be cleaned up and generalised rather than
-         * just tacked on to the end of main
-         */
-        if(serverstate.motd_state == MOTD_HAPPY) {
-            for(c = serverstate.client_list; c; c = c->next) {
-                if(c->motd_state == MOTD_WANT) {
-                    send_socket_messagev(serverstate.sock, NULL, NULL, NULL,
-                            CMD_MOTD, NULL);
-                    serverstate.motd_state = MOTD_WANT;
-                    break;
-                }
-
-                if(c->motd_state == MOTD_READING) {
-                    fprintf(stderr, "consistency failure: client in "
-                            "MOTD_READING state while server in MOTD_HAPPY\n");
-                }
-            }
+    for(i = 0; i < nshards; i++) {
+        if((err = pthread_create(&(shard[i].thread), NULL, run_shard,
+                        shard + i))) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            exit(1);
         }
     }
+
+    while(1) {
+        if(sigwait(&sigs, &sig) != 0 || sig != SIGUSR1)
+            continue;
+
+        for(i = 0; i < nshards; i++)
+            if(write(shard[i].wakefd[1], "", 1) == -1 && errno != EAGAIN)
+                perror("write");
+    }
 }
@@ -0,0 +1,89 @@
+/* Name handling for muxirc
+ *
+ * Each server keeps a table of the nicks it knows about (ours and those of
+ * the members of its channels), so that a nick is stored and hashed once
+ * however many channels it is in, and so that finding it in a channel's
+ * member table compares pointers rather than strings.
+ *
+ * James Stanley 2012
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "table.h"
+#include "name.h"
+#include "str.h"
+
+/* return the string of the name, for the name table */
+static const char *name_str(const void *n) {
+    return ((const Name *)n)->str;
+}
+
+/* initialise an empty table of names compared under casemap */
+void init_names(Table *names, int casemap) {
+    init_table(names, name_str, casemap);
+}
+
+/* return the name equal to str, or NULL if there is none; no reference is
+ * taken
+ */
+Name *find_name(const Table *names, const char *str) {
+    return table_lookup(names, str);
+}
+
+/* return a reference to the name equal to str, adding it if it is new; it
+ * keeps the spelling it was first given
+ */
+Name *intern_name(Table *names, const char *str) {
+    unsigned hash = irc_hash(names->casemap, str);
+    Name *n = table_lookup_hash(names, str, hash);
+
+    if(n) {
+        n->refs++;
+        return n;
+    }
+
+    size_t len = strlen(str);
+    n = malloc(sizeof(Name) + len + 1);
+    n->refs = 1;
+    n->hash = hash;
+    n->len = len;
+    memcpy(n->str, str, len + 1);
+    table_insert_hash(names, n, hash);
+
+    return n;
+}
+
+/* return another reference to the name */
+Name *ref_name(Name *n) {
+    n->refs++;
+    return n;
+}
+
+/* drop a reference to the name, removing it from the table when there are
+ * none left
+ */
+void free_name(Table *names, Name *n) {
+    if(--n->refs > 0)
+        return;
+
+    table_remove_hash(names, n->str, n->hash);
+    free(n);
+}
+
+/* change the case of the name to that of str, which must be equal to it */
+void respell_name(Name *n, const char *str) {
+    memcpy(n->str, str, n->len);
+}
+
+/* change the casemapping the names are compared under, rehashing them */
+void set_names_casemap(Table *names, int casemap) {
+    Name *n;
+    size_t i = 0;
+
+    table_set_casemap(names, casemap);
+
+    while((n = table_next(names, &i)))
+        n->hash = irc_hash(casemap, n->str);
+}
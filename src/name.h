@@ -0,0 +1,29 @@
+/* Name handling for muxirc
+ *
+ * James Stanley 2012
+ */
+
+#ifndef NAME_H_INC
+#define NAME_H_INC
+
+/* a nick that is kept once however many things refer to it; nicks that the
+ * casemapping considers equal are the same Name, so two Names from the same
+ * table are the same nick exactly when they are the same pointer; hash is
+ * irc_hash of str under the table's casemapping
+ */
+typedef struct Name {
+    int refs;
+    unsigned hash;
+    size_t len;
+    char str[];
+} Name;
+
+void init_names(Table *names, int casemap);
+Name *find_name(const Table *names, const char *str);
+Name *intern_name(Table *names, const char *str);
+Name *ref_name(Name *n);
+void free_name(Table *names, Name *n);
+void respell_name(Name *n, const char *str);
+void set_names_casemap(Table *names, int casemap);
+
+#endif
@@ -0,0 +1,196 @@
+/* Pool handling for muxirc
+ *
+ * James Stanley 2012
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "connect.h"
+#include "pool.h"
+#include "str.h"
+
+/* start with no servers */
+void init_pool(Pool *p) {
+    memset(p, 0, sizeof(Pool));
+    p->current = -1;
+}
+
+/* add a server given as host, host:port or [host]:port (for IPv6 addresses)
+ * to the pool, using defport if there is no port
+ */
+void add_upstream(Pool *p, const char *spec, const char *defport) {
+    const char *colon = strrchr(spec, ':');
+    Upstream *u;
+
+    p->up = realloc(p->up, (p->n + 1) * sizeof(Upstream));
+    u = p->up + p->n++;
+    memset(u, 0, sizeof(Upstream));
+    u->rtt = -1;
+    u->lastrtt = -1;
+    u->pingrtt = -1;
+    u->healthy = 1;
+
+    if(*spec == '[' && strchr(spec, ']')) {
+        const char *end = strchr(spec, ']');
+        u->host = strprefix(spec + 1, end - spec - 1);
+        u->port = strdup(end[1] == ':' && end[2] ? end + 2 : defport);
+    } else if(colon && colon == strchr(spec, ':') && colon[1]) {
+        u->host = strprefix(spec, colon - spec);
+        u->port = strdup(colon + 1);
+    } else {
+        u->host = strdup(spec);
+        u->port = strdup(defport);
+    }
+}
+
+/* take a new measurement of the round-trip time to the server into account,
+ * smoothing it in the same way as TCP does
+ */
+void upstream_rtt(Upstream *u, long rtt) {
+    if(rtt < 0)
+        return;
+
+    u->rtt = u->rtt < 0 ? rtt : (7 * u->rtt + rtt) / 8;
+    u->lastrtt = rtt;
+    u->nsamples++;
+    u->healthy = 1;
+    u->failures = 0;
+}
+
+/* take a new measurement of how long the server took to answer a PING into
+ * account
+ */
+void upstream_ping(Upstream *u, long rtt) {
+    u->pingrtt = u->pingrtt < 0 ? rtt : (7 * u->pingrtt + rtt) / 8;
+}
+
+/* the server couldn't be connected to, or the connection to it went bad */
+void upstream_failed(Upstream *u) {
+    u->healthy = 0;
+    u->failures++;
+}
+
+/* handle the outcome of a probe, keeping its round-trip time but not the
+ * connection
+ */
+static void handle_probe(void *data, int fd) {
+    Upstream *u = data;
+
+    u->probing = 0;
+
+    if(fd == -1) {
+        upstream_failed(u);
+        return;
+    }
+
+    upstream_rtt(u, u->probe.rtt);
+    close(fd);
+}
+
+/* probe every server, including the one we are using, so that they are all
+ * compared by connections made at about the same time
+ */
+static void handle_probe_timer(void *data) {
+    Pool *p = data;
+    int i;
+
+    for(i = 0; i < p->n; i++) {
+        Upstream *u = p->up + i;
+
+        if(u->probing)
+            continue;
+
+        if(start_connect(&(u->probe), u->host, u->port, handle_probe, u) == 0)
+            u->probing = 1;
+    }
+
+    add_timer(&(p->probetimer), POOL_PROBE_INTERVAL, handle_probe_timer, p);
+}
+
+/* start measuring the round-trip times to the servers; with only one
+ * server there is no choice to make, so nothing needs measuring
+ */
+void start_probes(Pool *p) {
+    if(p->n > 1)
+        add_timer(&(p->probetimer), 0, handle_probe_timer, p);
+}
+
+/* return non-zero if a should be chosen over b: a known round-trip time
+ * beats an unknown one, and otherwise the shorter wins
+ */
+static int closer(const Upstream *a, const Upstream *b) {
+    if(a->rtt < 0 || b->rtt < 0)
+        return a->rtt >= 0 && b->rtt < 0;
+    return a->rtt < b->rtt;
+}
+
+/* return the index of the server that should be connected to: the closest
+ * of those that are healthy, or if none are, the one that has failed the
+ * fewest times in a row
+ */
+int choose_upstream(Pool *p) {
+    int best = -1;
+    int i;
+
+    for(i = 0; i < p->n; i++)
+        if(p->up[i].healthy && (best == -1 || closer(p->up + i, p->up + best)))
+            best = i;
+
+    if(best != -1)
+        return best;
+
+    for(i = 0, best = 0; i < p->n; i++)
+        if(p->up[i].failures < p->up[best].failures)
+            best = i;
+
+    return best;
+}
+
+/* return the index of a healthy server that is enough closer than the one
+ * we are connected to that it is worth moving to it, or -1 if there is none
+ */
+int better_upstream(Pool *p) {
+    int best = choose_upstream(p);
+
+    if(p->current == -1 || best == p->current)
+        return -1;
+
+    Upstream *u = p->up + best;
+    Upstream *cur = p->up + p->current;
+
+    if(!u->healthy || u->rtt < 0 || cur->rtt < 0)
+        return -1;
+
+    return u->rtt + POOL_SWITCH_MARGIN < cur->rtt ? best : -1;
+}
+
+/* return the number of servers that haven't failed */
+int healthy_upstreams(Pool *p) {
+    int i, n = 0;
+
+    for(i = 0; i < p->n; i++)
+        n += p->up[i].healthy;
+
+    return n;
+}
+
+/* write what we know about each server to stderr */
+void dump_pool_stats(Pool *p) {
+    int i;
+
+    fprintf(stderr, "  %d upstream servers, %d failovers, %d switches\n",
+            p->n, p->failovers, p->switches);
+
+    for(i = 0; i < p->n; i++) {
+        Upstream *u = p->up + i;
+        fprintf(stderr, "  %c %s:%s: rtt %ld ms (last %ld ms, %d samples), "
+                "ping %ld ms, %s, %d failures, %d connects\n",
+                i == p->current ? '*' : ' ', u->host, u->port, u->rtt,
+                u->lastrtt, u->nsamples, u->pingrtt,
+                u->healthy ? "healthy" : "failed", u->failures, u->connects);
+    }
+}
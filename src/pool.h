@@ -0,0 +1,62 @@
+/* Pool handling for muxirc
+ *
+ * James Stanley 2012
+ */
+
+#ifndef POOL_H_INC
+#define POOL_H_INC
+
+/* every server (even the one we are connected to) is connected to, and
+ * straight away disconnected from, this often, to find out how far away it
+ * is
+ */
+#define POOL_PROBE_INTERVAL (5 * 60 * 1000)
+
+/* a server's round-trip time has to be this many milliseconds shorter than
+ * that of the server we are connected to before it is worth moving to
+ */
+#define POOL_SWITCH_MARGIN 100
+
+/* a server that we could connect to; rtt is how long connecting to it takes,
+ * which is what servers are compared by, and pingrtt how long it takes to
+ * answer our PINGs while we are connected to it, which includes the time
+ * the server spends on them and so is only for showing
+ */
+typedef struct Upstream {
+    char *host;
+    char *port;
+    long rtt;
+    long lastrtt;
+    int nsamples;
+    long pingrtt;
+    int healthy;
+    int failures;
+    int connects;
+    int probing;
+    Connector probe;
+} Upstream;
+
+/* the servers we could connect to; current is the one that we are connected
+ * (or connecting) to, or -1
+ */
+typedef struct Pool {
+    Upstream *up;
+    int n;
+    int current;
+    int failovers;
+    int switches;
+    Timer probetimer;
+} Pool;
+
+void init_pool(Pool *p);
+void add_upstream(Pool *p, const char *spec, const char *defport);
+void start_probes(Pool *p);
+int choose_upstream(Pool *p);
+int better_upstream(Pool *p);
+int healthy_upstreams(Pool *p);
+void upstream_rtt(Upstream *u, long rtt);
+void upstream_ping(Upstream *u, long rtt);
+void upstream_failed(Upstream *u);
+void dump_pool_stats(Pool *p);
+
+#endif
@@ -0,0 +1,643 @@
+/* Request handling for muxirc
+ *
+ * James Stanley 2012
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <stdarg.h>
+
+#include "event.h"
+#include "buffer.h"
+#include "table.h"
+#include "slab.h"
+#include "socket.h"
+#include "worker.h"
+#include "connect.h"
+#include "pool.h"
+#include "sched.h"
+#include "message.h"
+#include "client.h"
+#include "config.h"
+#include "server.h"
+#include "channel.h"
+#include "request.h"
+#include "str.h"
+
+/* what we PING the server with after each request, followed by a number of
+ * the request's own; the server answers requests in order, so when the PONG
+ * comes back every line of the reply has been seen, even for replies (like
+ * LUSERS) that have no end numeric
+ */
+#define REQUEST_FENCE "muxirc-"
+
+size_t cache_budget = CACHE_DEFAULT_BUDGET;
+
+/* a numeric that is part of a reply, and which of its parameters names the
+ * target of the request (e.g. the channel a NAMES was for), so that it can
+ * be told apart from the same numeric sent for some other reason; the first
+ * parameter is always our nick, so 0 means there is nothing to check
+ */
+typedef struct ReplyNumeric {
+    int numeric;
+    int target;
+} ReplyNumeric;
+
+/* the numerics that make up the reply to a command, and for how many seconds
+ * the reply may be given to other clients (0 means only the clients whose
+ * requests were in flight together share it)
+ */
+typedef struct ReplySpec {
+    int command;
+    int ttl;
+    ReplyNumeric numeric[20];
+} ReplySpec;
+
+static const ReplySpec reply_spec[] = {
+    { CMD_MOTD, 3600, { { RPL_MOTDSTART }, { RPL_MOTD }, { RPL_ENDOFMOTD },
+        { ERR_NOMOTD } } },
+    { CMD_LIST, 300, { { RPL_LISTSTART }, { RPL_LIST }, { RPL_LISTEND } } },
+    { CMD_LUSERS, 60, { { RPL_STATSCONN }, { RPL_LUSERCLIENT },
+        { RPL_LUSEROP }, { RPL_LUSERUNKNOWN }, { RPL_LUSERCHANNELS },
+        { RPL_LUSERME }, { RPL_LOCALUSERS }, { RPL_GLOBALUSERS } } },
+    { CMD_VERSION, 3600, { { RPL_VERSION }, { RPL_ISUPPORT } } },
+    { CMD_ADMIN, 3600, { { RPL_ADMINME }, { RPL_ADMINLOC1 },
+        { RPL_ADMINLOC2 }, { RPL_ADMINEMAIL }, { ERR_NOADMININFO } } },
+    { CMD_INFO, 3600, { { RPL_INFO }, { RPL_INFOSTART },
+        { RPL_ENDOFINFO } } },
+    { CMD_WHO, 0, { { RPL_WHOREPLY }, { RPL_WHOSPCRPL },
+        { RPL_ENDOFWHO, 1 } } },
+    { CMD_WHOIS, 0, { { RPL_WHOISCERTFP, 1 }, { RPL_AWAY, 1 },
+        { RPL_WHOISREGNICK, 1 }, { RPL_WHOISUSER, 1 },
+        { RPL_WHOISSERVER, 1 }, { RPL_WHOISOPERATOR, 1 },
+        { RPL_WHOISIDLE, 1 }, { RPL_ENDOFWHOIS, 1 },
+        { RPL_WHOISCHANNELS, 1 }, { RPL_WHOISSPECIAL, 1 },
+        { RPL_WHOISACCOUNT, 1 }, { RPL_WHOISACTUALLY, 1 },
+        { RPL_WHOISHOST, 1 }, { RPL_WHOISMODES, 1 },
+        { RPL_WHOISSECURE, 1 }, { ERR_NOSUCHNICK, 1 },
+        { ERR_NOSUCHSERVER, 1 } } },
+    { CMD_MODE, 0, { { RPL_UMODEIS }, { RPL_CHANNELMODEIS, 1 },
+        { RPL_CREATIONTIME, 1 }, { ERR_NOSUCHCHANNEL, 1 } } },
+    { CMD_NAMES, 0, { { RPL_NAMREPLY, 2 }, { RPL_ENDOFNAMES, 1 },
+        { ERR_NOSUCHCHANNEL, 1 } } },
+    { CMD_TOPIC, 0, { { RPL_NOTOPIC, 1 }, { RPL_TOPIC, 1 },
+        { RPL_TOPICWHOTIME, 1 }, { ERR_NOSUCHCHANNEL, 1 } } },
+    { 0 }
+};
+
+/* return the key of a cached reply */
+const char *request_key(const void *r) {
+    return ((const Request *)r)->key;
+}
+
+/* return the reply spec for the given command, or NULL if there is none */
+static const ReplySpec *lookup_spec(int command) {
+    const ReplySpec *spec;
+
+    for(spec = reply_spec; spec->command; spec++)
+        if(spec->command == command)
+            return spec;
+
+    return NULL;
+}
+
+/* return 1 if the numeric is part of the reply to the request */
+static int wants_numeric(Server *s, const Request *r, const Message *m) {
+    const ReplyNumeric *n;
+
+    for(n = r->spec->numeric; n->numeric; n++) {
+        if(n->numeric != m->command)
+            continue;
+
+        /* a numeric about something else isn't part of this reply */
+        return !n->target || !r->target || (m->nparams > n->target
+                && irc_strcasecmp(s->casemapping, m->param[n->target],
+                    r->target) == 0);
+    }
+
+    /* the server refusing the command (e.g. LIST being rate-limited) is a
+     * reply, but not one worth caching
+     */
+    return (m->command == RPL_TRYAGAIN || m->command == ERR_UNKNOWNCOMMAND)
+        && m->nparams >= 2
+        && strcasecmp(m->param[1], command_string[r->spec->command
+                - FIRST_CMD]) == 0;
+}
+
+/* return 1 if any of the numerics in the reply name the target */
+static int names_target(const ReplySpec *spec) {
+    const ReplyNumeric *n;
+
+    for(n = spec->numeric; n->numeric; n++)
+        if(n->target)
+            return 1;
+
+    return 0;
+}
+
+/* return the key for a message: the command and its parameters */
+static char *message_key(const Message *m) {
+    char key[512];
+    char *endptr = key;
+    int i;
+
+    strappend(key, &endptr, sizeof(key) - 1,
+            command_string[m->command - FIRST_CMD]);
+    for(i = 0; i < m->nparams; i++) {
+        strappend(key, &endptr, sizeof(key) - 1, " ");
+        strappend(key, &endptr, sizeof(key) - 1, m->param[i]);
+    }
+
+    return strdup(key);
+}
+
+/* return a new request for the given spec */
+static Request *new_request(const ReplySpec *spec, char *key) {
+    Request *r = malloc(sizeof(Request));
+    memset(r, 0, sizeof(Request));
+    r->spec = spec;
+    r->key = key;
+    r->capturing = 1;
+    return r;
+}
+
+/* free a request that is in no list */
+static void free_request(Request *r) {
+    free(r->key);
+    free(r->target);
+    if(r->query)
+        free_message(r->query);
+    free(r->fence);
+    free(r->label);
+    free(r->batch);
+    free_queue(&(r->reply));
+    free(r->waiter);
+    free(r);
+}
+
+/* give the client everything that has been captured of the reply so far,
+ * without copying it
+ */
+static void replay_request(Client *c, Request *r) {
+    QueueNode *n;
+
+    for(n = r->reply.head; n; n = n->next)
+        send_socket_buffer(&c->sock, n->buf);
+}
+
+/* add the client to the clients waiting for the reply */
+static void add_waiter(Request *r, Client *c) {
+    r->waiter = realloc(r->waiter, (r->nwaiters + 1) * sizeof(Client *));
+    r->waiter[r->nwaiters++] = c;
+}
+
+/* unlink the cached reply and forget about it */
+static void remove_cached(Server *s, Request *r) {
+    if(r->prev)
+        r->prev->next = r->next;
+    else
+        s->cache_head = r->next;
+    if(r->next)
+        r->next->prev = r->prev;
+    else
+        s->cache_tail = r->prev;
+
+    table_remove(&(s->cache), r->key);
+    s->cache_bytes -= r->reply.bytes;
+    free_request(r);
+}
+
+/* keep the finished reply for other clients, throwing away the oldest
+ * replies until the cache fits in its budget again
+ */
+static void cache_request(Server *s, Request *r) {
+    Request *old = table_lookup(&(s->cache), r->key);
+    if(old)
+        remove_cached(s, old);
+
+    r->expires = time(NULL) + r->spec->ttl;
+    r->nwaiters = 0;
+    r->prev = s->cache_tail;
+    r->next = NULL;
+    if(s->cache_tail)
+        s->cache_tail->next = r;
+    else
+        s->cache_head = r;
+    s->cache_tail = r;
+
+    table_insert(&(s->cache), r);
+    s->cache_bytes += r->reply.bytes;
+
+    while(s->cache_bytes > cache_budget)
+        remove_cached(s, s->cache_head);
+}
+
+/* the whole reply to the request has been seen; cache it if possible */
+static void finish_request(Server *s, Request *r) {
+    if(r->failed || !r->capturing || r->spec->ttl == 0
+            || r->reply.bytes > cache_budget)
+        free_request(r);
+    else
+        cache_request(s, r);
+}
+
+/* give a line of the reply to the request that is being handled to the
+ * clients waiting for it, and capture it
+ */
+void send_reply(Server *s, Buffer *buf) {
+    Request *r = s->reply;
+    int i;
+
+    if(r->broadcast)
+        send_all_buffer(s, NULL, buf);
+    else
+        for(i = 0; i < r->nwaiters; i++)
+            send_socket_buffer(&r->waiter[i]->sock, buf);
+
+    /* once a reply is too big to cache, stop keeping it */
+    if(r->capturing) {
+        if(r->reply.bytes + buf->len > cache_budget) {
+            r->capturing = 0;
+            free_queue(&(r->reply));
+        } else {
+            queue_append(&(r->reply), buf->data, buf->len);
+        }
+    }
+}
+
+/* handle a request from a client for something whose reply can be shared:
+ * give it a cached reply if there is one, join an identical request that is
+ * already waiting for the server, or else ask the server
+ */
+int handle_request(Client *c, const Message *m) {
+    Server *s = c->server;
+    const ReplySpec *spec = lookup_spec(m->command);
+    Request *r;
+
+    /* the JOINs and PARTs waiting to be sent came first */
+    send_channel_batch(s);
+
+    /* replies to WHOIS name the nick, which may come after a server name */
+    const char *target = m->nparams == 0 ? NULL
+        : m->param[m->command == CMD_WHOIS ? m->nparams - 1 : 0];
+
+    /* the replies for a list of targets (e.g. WHOIS a,b) each name one of
+     * them, so they can't be told apart from replies to anything else
+     */
+    if(target && strchr(target, ',') && names_target(spec)) {
+        forward_message(c, m);
+        return 0;
+    }
+
+    char *key = message_key(m);
+
+    /* a cached reply that is still fresh needs no upstream traffic */
+    if((r = table_lookup(&(s->cache), key))) {
+        if(r->expires > time(NULL)) {
+            replay_request(c, r);
+            free(key);
+            return 0;
+        }
+
+        remove_cached(s, r);
+    }
+
+    /* a request that is already on its way only needs to tell this client
+     * about the part of the reply it has missed
+     */
+    for(r = s->request_head; r; r = r->next) {
+        if(r->capturing && !r->failed && strcmp(r->key, key) == 0) {
+            replay_request(c, r);
+            add_waiter(r, c);
+            free(key);
+            return 0;
+        }
+    }
+
+    r = new_request(spec, key);
+    add_waiter(r, c);
+
+    if(target)
+        r->target = strdup(target);
+
+    if(s->request_tail)
+        s->request_tail->next = r;
+    else
+        s->request_head = r;
+    s->request_tail = r;
+
+    /* until the server has finished welcoming us, the request waits (e.g.
+     * the NAMES for a client that attaches while we reconnect)
+     */
+    r->query = copy_message(m);
+    if(s->registered && !s->bursting)
+        send_requests(s);
+
+    return 0;
+}
+
+/* ask the server for the replies to the requests that are still waiting to
+ * be sent, once it is ready to answer them
+ */
+void send_requests(Server *s) {
+    Request *r;
+    char fence[32];
+
+    for(r = s->request_head; r; r = r->next) {
+        if(!r->query)
+            continue;
+
+        /* a client can PING with anything, so only the fence the request
+         * was sent with ends it
+         */
+        snprintf(fence, sizeof(fence), REQUEST_FENCE "%x", s->next_fence++);
+        r->fence = strdup(fence);
+
+        send_server_message(s, LANE_BACKGROUND, r->query);
+        send_server_messagev(s, LANE_BACKGROUND, CMD_PING, fence, NULL);
+
+        free_message(r->query);
+        r->query = NULL;
+    }
+}
+
+/* send a query to the server on behalf of the client, sharing the reply
+ * with other clients as handle_request would
+ */
+void request_messagev(Client *c, int command, ...) {
+    va_list argp;
+    Message m;
+
+    memset(&m, 0, sizeof(Message));
+    m.command = command;
+
+    va_start(argp, command);
+
+    const char *str;
+    while((str = va_arg(argp, const char *)))
+        add_message_param(&m, str);
+
+    va_end(argp);
+
+    handle_request(c, &m);
+}
+
+/* send a message from the client to the server; if the server can label its
+ * replies, label it so that they only go back to this client, and otherwise
+ * remember who sent it so that we can guess where the replies should go
+ */
+void forward_message(Client *c, const Message *m) {
+    Server *s = c->server;
+
+    /* the JOINs and PARTs waiting to be sent came first (e.g. a PRIVMSG to a
+     * channel just joined must follow the JOIN)
+     */
+    send_channel_batch(s);
+
+    if(!(s->caps & CAP_LABELS)) {
+        s->last_client = c;
+        s->last_sent = time(NULL);
+        send_server_message(s, LANE_INTERACTIVE, m);
+        return;
+    }
+
+    char label[16];
+    snprintf(label, sizeof(label), "label=%x", s->next_label++);
+
+    Request *r = new_request(NULL, NULL);
+    r->label = strdup(label + 6);
+    r->capturing = 0;
+    add_waiter(r, c);
+
+    r->prev = s->label_tail;
+    if(s->label_tail)
+        s->label_tail->next = r;
+    else
+        s->label_head = r;
+    s->label_tail = r;
+
+    Message labelled = *m;
+    labelled.tags = label;
+    send_server_message(s, LANE_INTERACTIVE, &labelled);
+}
+
+/* return the labelled request whose label (or batch, if batch is set) is the
+ * len bytes at str
+ */
+static Request *find_label(Server *s, const char *str, size_t len,
+        int batch) {
+    Request *r;
+
+    for(r = s->label_head; r; r = r->next) {
+        const char *id = batch ? r->batch : r->label;
+        if(id && strlen(id) == len && strncmp(id, str, len) == 0)
+            return r;
+    }
+
+    return NULL;
+}
+
+/* the whole reply to a labelled request has been seen */
+static void end_label(Server *s, Request *r) {
+    if(r->prev)
+        r->prev->next = r->next;
+    else
+        s->label_head = r->next;
+    if(r->next)
+        r->next->prev = r->prev;
+    else
+        s->label_tail = r->prev;
+
+    free_request(r);
+}
+
+/* return the labelled request that a message from the server is the reply
+ * to, or part of the batch of replies to, or NULL if there is none
+ */
+static Request *label_request(Server *s, const Message *m) {
+    const char *tag;
+    size_t len;
+    Request *r;
+
+    if((tag = message_tag(m, "label", &len))
+            && (r = find_label(s, tag, len, 0))) {
+        /* the server answers in order, so anything older than this that
+         * isn't part-way through a batch will never be answered
+         */
+        while(s->label_head != r && !s->label_head->batch)
+            end_label(s, s->label_head);
+
+        /* the replies are in a batch */
+        if(m->command == CMD_BATCH && m->nparams >= 1
+                && m->param[0][0] == '+') {
+            free(r->batch);
+            r->batch = strdup(m->param[0] + 1);
+            return r;
+        }
+
+        /* things that the command made happen (e.g. a MODE change) are for
+         * everybody
+         */
+        if(m->command >= CMD_INVALID && m->command != CMD_ACK) {
+            end_label(s, r);
+            return NULL;
+        }
+
+        return r;
+    }
+
+    if((tag = message_tag(m, "batch", &len))
+            && (r = find_label(s, tag, len, 1)))
+        return m->command < CMD_INVALID ? r : NULL;
+
+    if(m->command == CMD_BATCH && m->nparams >= 1 && m->param[0][0] == '-'
+            && (r = find_label(s, m->param[0] + 1, strlen(m->param[0] + 1),
+                    1)))
+        return r;
+
+    return NULL;
+}
+
+/* return the request that a message from the server is part of the reply
+ * to, or NULL if it isn't part of any reply and should be handled as normal;
+ * the server answers requests in order, so only the oldest one can match
+ */
+Request *reply_request(Server *s, const Message *m) {
+    Request *r;
+
+    if(s->label_head && (r = label_request(s, m)))
+        return r;
+
+    if((r = s->request_head) && r->fence && wants_numeric(s, r, m)) {
+        /* the server refusing the command (e.g. LIST being rate-limited) is
+         * a reply, but not one worth caching
+         */
+        if(m->command == RPL_TRYAGAIN || m->command == ERR_UNKNOWNCOMMAND)
+            r->failed = 1;
+
+        return r;
+    }
+
+    /* servers send the MOTD unasked when we connect; everybody gets it, but
+     * it can be cached like any other
+     */
+    if(!s->motd && (m->command == RPL_MOTDSTART || m->command == ERR_NOMOTD)) {
+        s->motd = new_request(lookup_spec(CMD_MOTD), strdup("MOTD"));
+        /* after reconnecting, clients have already seen it */
+        s->motd->broadcast = s->reconnects == 0;
+    }
+
+    if(s->motd && wants_numeric(s, s->motd, m))
+        return s->motd;
+
+    return NULL;
+}
+
+/* the message from the server that was part of a reply has been handled */
+void end_reply(Server *s, const Message *m) {
+    Request *r = s->reply;
+
+    s->reply = NULL;
+
+    /* a labelled reply is one message, or a batch of them */
+    if(r->label) {
+        if(!r->batch || (m->command == CMD_BATCH && m->nparams >= 1
+                    && m->param[0][0] == '-'))
+            end_label(s, r);
+        return;
+    }
+
+    /* the MOTD we didn't ask for has no fence to end it */
+    if(r == s->motd
+            && (m->command == RPL_ENDOFMOTD || m->command == ERR_NOMOTD)) {
+        s->motd = NULL;
+        finish_request(s, r);
+    }
+}
+
+/* handle a PONG from the server; return 1 if it was the fence after the
+ * oldest request, which means that every line of its reply has been seen
+ */
+int end_request(Server *s, const Message *m) {
+    Request *r = s->request_head;
+
+    if(!r || !r->fence || m->nparams < 1
+            || strcmp(m->param[m->nparams - 1], r->fence) != 0)
+        return 0;
+
+    s->request_head = r->next;
+    if(!s->request_head)
+        s->request_tail = NULL;
+    r->next = NULL;
+    finish_request(s, r);
+
+    return 1;
+}
+
+/* forget about the client in all of the requests it is waiting for */
+void cancel_requests(Client *c) {
+    Server *s = c->server;
+    Request *list[] = { s->request_head, s->label_head };
+    Request *r;
+    int i, j;
+
+    for(j = 0; j < 2; j++)
+        for(r = list[j]; r; r = r->next)
+            for(i = 0; i < r->nwaiters; i++)
+                if(r->waiter[i] == c)
+                    r->waiter[i--] = r->waiter[--r->nwaiters];
+
+    if(s->last_client == c)
+        s->last_client = NULL;
+}
+
+/* forget about everything that was waiting for a reply from the server,
+ * which has gone away; cached replies are still good, and so are requests
+ * that were never sent, which always come after the ones that were
+ */
+void clear_requests(Server *s) {
+    Request *r;
+
+    while((r = s->request_head) && !r->query) {
+        s->request_head = r->next;
+        free_request(r);
+    }
+    if(!s->request_head)
+        s->request_tail = NULL;
+
+    while(s->label_head)
+        end_label(s, s->label_head);
+
+    if(s->motd) {
+        free_request(s->motd);
+        s->motd = NULL;
+    }
+
+    s->reply = NULL;
+    s->last_client = NULL;
+}
+
+/* throw away all cached replies (e.g. because they contain our old nick) */
+void flush_cache(Server *s) {
+    while(s->cache_head)
+        remove_cached(s, s->cache_head);
+}
+
+/* write the state of the requests and the cache to stderr */
+void dump_request_stats(Server *s) {
+    Request *r;
+    int n = 0;
+
+    int nlabels = 0;
+
+    for(r = s->request_head; r; r = r->next)
+        n++;
+    for(r = s->label_head; r; r = r->next)
+        nlabels++;
+
+    fprintf(stderr, "  %d requests and %d labelled commands waiting, %zu "
+            "cached replies using %zu of %zu bytes\n", n, nlabels,
+            s->cache.count, s->cache_bytes, cache_budget);
+}
@@ -0,0 +1,55 @@
+/* Request handling for muxirc
+ *
+ * James Stanley 2012
+ */
+
+#ifndef REQUEST_H_INC
+#define REQUEST_H_INC
+
+/* cached replies may use this many bytes in total unless told otherwise */
+#define CACHE_DEFAULT_BUDGET (4 * 1024 * 1024)
+
+extern size_t cache_budget;
+
+/* without labelled replies, numerics nobody else wants go to the last client
+ * to send the server a command if it did so within this many seconds
+ */
+#define REPLY_GUESS_TIME 10
+
+/* a query sent upstream on behalf of some clients; the reply is given to
+ * each of them as it arrives and is kept so that later clients can be given
+ * the same reply without asking the server again
+ */
+typedef struct Request {
+    char *key;
+    char *target;
+    Message *query;
+    char *fence;
+    char *label;
+    char *batch;
+    const struct ReplySpec *spec;
+    int broadcast;
+    int failed;
+    int capturing;
+    long expires;
+    Queue reply;
+    int nwaiters;
+    Client **waiter;
+    struct Request *prev, *next;
+} Request;
+
+const char *request_key(const void *r);
+int handle_request(Client *c, const Message *m);
+void send_requests(Server *s);
+void request_messagev(Client *c, int command, ...);
+void forward_message(Client *c, const Message *m);
+Request *reply_request(Server *s, const Message *m);
+void send_reply(Server *s, Buffer *buf);
+void end_reply(Server *s, const Message *m);
+int end_request(Server *s, const Message *m);
+void cancel_requests(Client *c);
+void clear_requests(Server *s);
+void flush_cache(Server *s);
+void dump_request_stats(Server *s);
+
+#endif
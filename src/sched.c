@@ -0,0 +1,162 @@
+/* Scheduler handling for muxirc
+ *
+ * James Stanley 2012
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "event.h"
+#include "buffer.h"
+#include "socket.h"
+#include "sched.h"
+
+long flood_penalty = FLOOD_DEFAULT_PENALTY;
+long flood_window = FLOOD_DEFAULT_WINDOW;
+
+static const char *lane_name[NLANES] = {
+    "urgent", "interactive", "background"
+};
+
+/* start with a full bucket of tokens for sending to sock */
+void init_sched(Sched *q, Socket *sock) {
+    memset(q, 0, sizeof(Sched));
+    q->sock = sock;
+    q->tokens = flood_window;
+    q->refilled = event_time();
+}
+
+/* throw away everything that is waiting to be sent */
+void clear_sched(Sched *q) {
+    int i;
+
+    del_timer(&(q->timer));
+
+    for(i = 0; i < NLANES; i++) {
+        Lane *l = q->lane + i;
+
+        while(l->head) {
+            SchedLine *line = l->head;
+            l->head = line->next;
+            free(line);
+        }
+
+        l->tail = NULL;
+        l->depth = 0;
+    }
+}
+
+/* add the tokens that have accumulated since the bucket was last refilled,
+ * up to the size of the bucket
+ */
+static void refill(Sched *q) {
+    long now = event_time();
+
+    q->tokens += now - q->refilled;
+    if(q->tokens > flood_window)
+        q->tokens = flood_window;
+    q->refilled = now;
+}
+
+/* send whatever there are now enough tokens for */
+static void handle_sched_timer(void *data) {
+    run_sched(data);
+}
+
+/* send the str to the socket as soon as the bucket allows, after everything
+ * already waiting in the same or an earlier lane; return -1 if the socket is
+ * in an error state and 0 otherwise
+ */
+int sched_string(Sched *q, int lane, const char *str, size_t len) {
+    Lane *l = q->lane + lane;
+    int i;
+
+    if(q->sock->error)
+        return -1;
+
+    /* if nothing is waiting and there are enough tokens, don't bother
+     * queueing
+     */
+    refill(q);
+    for(i = 0; i <= lane && !q->lane[i].head; i++)
+        ;
+    if(i > lane && q->tokens >= flood_penalty) {
+        q->tokens -= flood_penalty;
+        l->sent++;
+        return send_socket_string(q->sock, str, len);
+    }
+
+    SchedLine *line = malloc(sizeof(SchedLine) + len);
+    line->queued = event_time();
+    line->len = len;
+    line->next = NULL;
+    memcpy(line->data, str, len);
+
+    if(l->tail)
+        l->tail->next = line;
+    else
+        l->head = line;
+    l->tail = line;
+
+    if(++l->depth > l->maxdepth)
+        l->maxdepth = l->depth;
+
+    run_sched(q);
+
+    return 0;
+}
+
+/* send as many waiting lines as the bucket allows, most important first,
+ * and arrange to be called again when there are enough tokens for the next
+ */
+void run_sched(Sched *q) {
+    int i;
+
+    refill(q);
+
+    for(i = 0; i < NLANES; i++) {
+        Lane *l = q->lane + i;
+
+        while(l->head) {
+            if(q->tokens < flood_penalty) {
+                add_timer(&(q->timer), flood_penalty - q->tokens,
+                        handle_sched_timer, q);
+                return;
+            }
+
+            SchedLine *line = l->head;
+            long waited = q->refilled - line->queued;
+
+            l->head = line->next;
+            if(!l->head)
+                l->tail = NULL;
+            l->depth--;
+
+            l->sent++;
+            l->waited += waited;
+            if(waited > l->maxwait)
+                l->maxwait = waited;
+
+            q->tokens -= flood_penalty;
+            send_socket_string(q->sock, line->data, line->len);
+            free(line);
+        }
+    }
+}
+
+/* write the state of each lane to stderr */
+void dump_sched_stats(Sched *q) {
+    int i;
+
+    fprintf(stderr, "  upstream: %ld ms of tokens\n", q->tokens);
+
+    for(i = 0; i < NLANES; i++) {
+        Lane *l = q->lane + i;
+
+        fprintf(stderr, "    %s: %d waiting (at most %d), %lu sent, "
+                "waited %ld ms on average and %ld ms at most\n",
+                lane_name[i], l->depth, l->maxdepth, l->sent,
+                l->sent ? l->waited / (long)l->sent : 0, l->maxwait);
+    }
+}
@@ -0,0 +1,52 @@
+/* Scheduler handling for muxirc
+ *
+ * James Stanley 2012
+ */
+
+#ifndef SCHED_H_INC
+#define SCHED_H_INC
+
+/* by default, every line costs the 2 seconds of penalty RFC 1459 servers
+ * charge for it, and we let the penalty run up to 10 seconds ahead, as
+ * servers disconnect clients that go further
+ */
+#define FLOOD_DEFAULT_PENALTY 2000
+#define FLOOD_DEFAULT_WINDOW 10000
+
+extern long flood_penalty;
+extern long flood_window;
+
+/* lines in earlier lanes are always sent before lines in later ones */
+enum {
+    LANE_URGENT, LANE_INTERACTIVE, LANE_BACKGROUND, NLANES
+};
+
+typedef struct SchedLine {
+    long queued;
+    size_t len;
+    struct SchedLine *next;
+    char data[];
+} SchedLine;
+
+typedef struct Lane {
+    SchedLine *head, *tail;
+    int depth, maxdepth;
+    unsigned long sent;
+    long waited, maxwait;
+} Lane;
+
+typedef struct Sched {
+    Socket *sock;
+    Lane lane[NLANES];
+    long tokens;
+    long refilled;
+    Timer timer;
+} Sched;
+
+void init_sched(Sched *q, Socket *sock);
+void clear_sched(Sched *q);
+int sched_string(Sched *q, int lane, const char *str, size_t len);
+void run_sched(Sched *q);
+void dump_sched_stats(Sched *q);
+
+#endif
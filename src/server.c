@@ -3,6 +3,8 @@
  * James Stanley 2012
  */
 
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -13,50 +15,88 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
-
+#include <fcntl.h>
+#include <time.h>
+
+#include "event.h"
+#include "buffer.h"
+#include "table.h"
+#include "name.h"
+#include "slab.h"
 #include "socket.h"
+#include "worker.h"
+#include "connect.h"
+#include "pool.h"
+#include "sched.h"
 #include "message.h"
 #include "client.h"
+#include "config.h"
 #include "server.h"
 #include "channel.h"
+#include "request.h"
+#include "str.h"
 
 typedef int(*ServerMessageHandler)(Server *, const Message *);
 
 static ServerMessageHandler message_handler[NCOMMANDS];
 
 static int handle_ignore(Server *, const Message *);
+static int handle_cap(Server *, const Message *);
 static int handle_join(Server *, const Message *);
 static int handle_part(Server *, const Message *);
+static int handle_kick(Server *, const Message *);
+static int handle_quit(Server *, const Message *);
 static int handle_nick(Server *, const Message *);
+static int handle_mode(Server *, const Message *);
+static int handle_names(Server *, const Message *);
 static int handle_topic(Server *, const Message *);
 static int handle_ping(Server *, const Message *);
+static int handle_pong(Server *, const Message *);
 static int handle_welcome(Server *, const Message *);
-static int handle_motd(Server *, const Message *);
 static int handle_nickinuse(Server *, const Message *);
+static int handle_joinfail(Server *, const Message *);
+static void handle_server_event(void *, int);
+static void handle_reconnect_timer(void *);
+static void connected_server(void *, int);
+static void wait_reconnect(Server *);
+static void handle_ping_timer(void *);
 
 /* initialise handler functions for server messages */
 void init_server_handlers(void) {
     message_handler[CMD_JOIN] = handle_join;
     message_handler[CMD_PART] = handle_part;
+    message_handler[CMD_KICK] = handle_kick;
+    message_handler[CMD_QUIT] = handle_quit;
     message_handler[CMD_NICK] = handle_nick;
+    message_handler[CMD_MODE] = handle_mode;
+    message_handler[RPL_NAMREPLY] = handle_names;
+    message_handler[RPL_ENDOFNAMES] = handle_names;
     message_handler[CMD_TOPIC] = handle_topic;
+    message_handler[RPL_NOTOPIC] = handle_topic;
     message_handler[RPL_TOPIC] = handle_topic;
-    message_handler[CMD_CAP] = handle_ignore;
+    message_handler[RPL_TOPICWHOTIME] = handle_topic;
+    message_handler[CMD_CAP] = handle_cap;
+    message_handler[CMD_BATCH] = handle_ignore;
+    message_handler[CMD_ACK] = handle_ignore;
     message_handler[CMD_PING] = handle_ping;
+    message_handler[CMD_PONG] = handle_pong;
     message_handler[RPL_WELCOME] = handle_welcome;
     message_handler[RPL_YOURHOST] = handle_welcome;
     message_handler[RPL_CREATED] = handle_welcome;
     message_handler[RPL_MYINFO] = handle_welcome;
     message_handler[RPL_ISUPPORT] = handle_welcome;
-    message_handler[RPL_MOTDSTART] = handle_motd;
-    message_handler[RPL_MOTD] = handle_motd;
-    message_handler[RPL_ENDOFMOTD] = handle_motd;
     message_handler[ERR_NICKNAMEINUSE] = handle_nickinuse;
+    message_handler[ERR_TOOMANYCHANNELS] = handle_joinfail;
+    message_handler[ERR_CHANNELISFULL] = handle_joinfail;
+    message_handler[ERR_INVITEONLYCHAN] = handle_joinfail;
+    message_handler[ERR_BANNEDFROMCHAN] = handle_joinfail;
+    message_handler[ERR_BADCHANNELKEY] = handle_joinfail;
+    message_handler[ERR_NEEDREGGEDNICK] = handle_joinfail;
 }
 
 /* return a pointer to a static array containing a random nick */
 static char *random_nick(void) {
-    static char nick[9];
+    static __thread char nick[9];
     int i;
 
     for(i = 0; i < 8; i++)
@@ -66,10 +106,220 @@ static char *random_nick(void) {
     return nick;
 }
 
-/* connect to irc and initialise the server state */
-void irc_connect(Server *s, const char *server, const char *serverport,
-        const char *serverpass, const char *username, const char *realname,
-        const char *listenport, const char *pass) {
+/* change our nick (or just its case) to nick */
+static void set_nick(Server *s, const char *nick) {
+    Name *me = intern_name(&(s->names), nick);
+
+    respell_name(me, nick);
+    if(s->me)
+        free_name(&(s->names), s->me);
+
+    s->me = me;
+    s->nick = me->str;
+}
+
+/* return whether nick is ours, which it is only if it is our Name */
+static int is_us(Server *s, const char *nick) {
+    return find_name(&(s->names), nick) == s->me;
+}
+
+/* start connecting to the best server there is without waiting for it;
+ * return 0 if it has started and -1 on error
+ */
+static int connect_server(Server *s) {
+    int last = s->pool.current;
+
+    s->pool.current = choose_upstream(&(s->pool));
+    if(last != -1 && last != s->pool.current)
+        s->pool.failovers++;
+
+    Upstream *u = s->pool.up + s->pool.current;
+    fprintf(stderr, "muxirc: connecting to %s:%s\n", u->host, u->port);
+
+    return start_connect(&(s->connector), u->host, u->port, connected_server,
+            s);
+}
+
+/* go straight on to another server if there are any that haven't failed,
+ * or else wait a while and try again
+ */
+static void retry_server(Server *s) {
+    if(healthy_upstreams(&(s->pool)))
+        add_timer(&(s->reconnect), 0, handle_reconnect_timer, s);
+    else
+        wait_reconnect(s);
+}
+
+/* handle the outcome of connecting to the server by registering with it,
+ * or trying another if it couldn't be reached
+ */
+static void connected_server(void *data, int fd) {
+    Server *s = data;
+    Upstream *u = s->pool.up + s->pool.current;
+
+    if(fd == -1) {
+        fprintf(stderr, "error: failed to connect to %s:%s\n", u->host,
+                u->port);
+        upstream_failed(u);
+        retry_server(s);
+        return;
+    }
+
+    s->sock->fd = fd;
+    s->sock->error = 0;
+
+    if(add_event(&(s->sock->ev), fd, EV_READ | EV_WRITE, handle_server_event,
+                s) != 0) {
+        close_socket(s->sock);
+        retry_server(s);
+        return;
+    }
+
+    u->connects++;
+    upstream_rtt(u, s->connector.rtt);
+
+    init_sched(&(s->sched), s->sock);
+    s->bursting = 1;
+
+    /* now register with the server, finding out which capabilities it has
+     * first (servers without any will just say CAP is an unknown command)
+     */
+    send_server_messagev(s, LANE_URGENT, CMD_CAP, "LS", "302", NULL);
+    if(s->upstream_pass)
+        send_server_messagev(s, LANE_URGENT, CMD_PASS, s->upstream_pass,
+                NULL);
+    send_server_messagev(s, LANE_URGENT, CMD_NICK, s->nick, NULL);
+    send_server_messagev(s, LANE_URGENT, CMD_USER, s->username, "localhost",
+            u->host, s->realname, NULL);
+
+    /* TODO: Something that will reliably cause us to be told our user and
+     * host so that it will get set (send us a pm?). We need to give the
+     * server long enough to decide whether or not our nick is taken though.
+     * Perhaps waiting for any of:
+     *  1.) A 001 (RPL_WELCOME) message (success)
+     *  2.) 5 seconds to pass (assume success)
+     *  3.) A 433 (ERR_NICKNAMEINUSE) message (failure)
+     */
+}
+
+/* try connecting to the server again after a while, waiting longer each time
+ * so that a server that is down isn't hammered
+ */
+static void wait_reconnect(Server *s) {
+    if(s->backoff < RECONNECT_MIN)
+        s->backoff = RECONNECT_MIN;
+
+    fprintf(stderr, "muxirc: reconnecting in %ld ms\n", s->backoff);
+    add_timer(&(s->reconnect), s->backoff, handle_reconnect_timer, s);
+
+    s->backoff *= 2;
+    if(s->backoff > RECONNECT_MAX)
+        s->backoff = RECONNECT_MAX;
+}
+
+/* it is time to try connecting to the server again */
+static void handle_reconnect_timer(void *data) {
+    Server *s = data;
+
+    if(connect_server(s) != 0)
+        wait_reconnect(s);
+}
+
+/* close the connection to the server and forget everything that only made
+ * sense on that connection, keeping the clients and the channels so that
+ * clients carry on as if nothing had happened, and telling them why
+ */
+static void drop_server(Server *s, const char *why) {
+    close_socket(s->sock);
+    clear_sched(&(s->sched));
+    clear_requests(s);
+    lost_channels(s);
+    del_timer(&(s->pingtimer));
+    s->pingsent = 0;
+    s->caps = 0;
+    s->registered = 0;
+    s->reconnects++;
+
+    send_all_messagev(s, NULL, s->servername, NULL, NULL, CMD_NOTICE, s->nick,
+            why, NULL);
+}
+
+/* the connection to the server has gone bad, so try another one */
+static void lost_server(Server *s) {
+    Upstream *u = s->pool.up + s->pool.current;
+
+    fprintf(stderr, "muxirc: lost connection to %s:%s\n", u->host, u->port);
+
+    upstream_failed(u);
+    drop_server(s, "muxirc: lost connection to the server, reconnecting");
+    retry_server(s);
+}
+
+/* move to a server that is closer than the one we are connected to */
+static void switch_server(Server *s) {
+    Upstream *u = s->pool.up + s->pool.current;
+
+    fprintf(stderr, "muxirc: leaving %s:%s for a closer server\n", u->host,
+            u->port);
+
+    /* we are going away, so there is no need to wait for flood control */
+    send_socket_messagev(s->sock, NULL, NULL, NULL, CMD_QUIT,
+            "Changing servers", NULL);
+    flush_socket(s->sock);
+
+    s->pool.switches++;
+    s->pool.current = -1;
+    drop_server(s, "muxirc: moving to a closer server, reconnecting");
+    add_timer(&(s->reconnect), 0, handle_reconnect_timer, s);
+}
+
+/* PING the server to make sure it is still there (and see how quickly it
+ * answers), giving up on it if the last PING was never answered, and move to
+ * another server if one is closer
+ */
+static void handle_ping_timer(void *data) {
+    Server *s = data;
+
+    if(s->pingsent) {
+        fprintf(stderr, "muxirc: no reply to PING\n");
+        lost_server(s);
+        return;
+    }
+
+    if(better_upstream(&(s->pool)) != -1) {
+        switch_server(s);
+        return;
+    }
+
+    /* going through flood control would count the time spent waiting for
+     * tokens as distance to the server
+     */
+    s->pingsent = event_time();
+    send_socket_messagev(s->sock, NULL, NULL, NULL, CMD_PING, PING_TOKEN,
+            NULL);
+
+    add_timer(&(s->pingtimer), PING_INTERVAL, handle_ping_timer, s);
+}
+
+/* handle activity on the connection to the server */
+static void handle_server_event(void *data, int events) {
+    Server *s = data;
+
+    if(events & EV_ERROR) {
+        lost_server(s);
+        return;
+    }
+
+    if(events & EV_READ)
+        handle_server_data(s);
+    if(events & EV_WRITE)
+        flush_socket(s->sock);
+}
+
+/* initialise the server state for the network, start listening for its
+ * clients and start connecting to it
+ */
+void irc_connect(Server *s, const Network *net) {
     int yes = 1;
     struct addrinfo hints, *servinfo, *p;
     int n;
@@ -77,12 +327,29 @@ void irc_connect(Server *s, const char *server, const char *serverport,
 
     /* initialise all of s */
     memset(s, 0, sizeof(Server));
+    s->name = strdup(net->name);
     s->listenfd = -1;
-    s->nick = strdup(random_nick());
+    init_names(&(s->names), CASEMAP_RFC1459);
+    set_nick(s, random_nick());
     s->host = strdup("mux.irc");
-    if(pass)
-        s->pass = strdup(pass);
+    if(net->pass)
+        s->pass = strdup(net->pass);
     s->sock = new_socket();
+    init_sched(&(s->sched), s->sock);
+    s->servername = strdup("mux.irc");
+    s->casemapping = CASEMAP_RFC1459;
+    init_table(&(s->channels), channel_name, s->casemapping);
+    init_slab(&(s->channel_slab), sizeof(Channel));
+    init_slab(&(s->client_slab), sizeof(Client));
+    init_table(&(s->cache), request_key, CASEMAP_ASCII);
+
+    /* RFC 1459 modes, until the server tells us otherwise */
+    s->prefix_modes = strdup("ov");
+    s->prefix_chars = strdup("@+");
+    s->chanmodes[0] = strdup("b");
+    s->chanmodes[1] = strdup("k");
+    s->chanmodes[2] = strdup("l");
+    s->chanmodes[3] = strdup("imnpst");
 
     /* setup hints for the listening socket */
     memset(&hints, 0, sizeof(hints));
@@ -90,7 +357,7 @@ void irc_connect(Server *s, const char *server, const char *serverport,
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_PASSIVE;
 
-    if((n = getaddrinfo(NULL, listenport, &hints, &servinfo))) {
+    if((n = getaddrinfo(NULL, net->listenport, &hints, &servinfo))) {
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(n));
         close(s->sock->fd);
         exit(1);
@@ -119,7 +386,8 @@ void irc_connect(Server *s, const char *server, const char *serverport,
     freeaddrinfo(servinfo);
 
     if(!p) {
-        fprintf(stderr, "error: failed to bind to port %s\n", listenport);
+        fprintf(stderr, "error: failed to bind to port %s\n",
+                net->listenport);
         exit(1);
     }
 
@@ -128,109 +396,148 @@ void irc_connect(Server *s, const char *server, const char *serverport,
         exit(1);
     }
 
+    /* new connections are accepted until EAGAIN, so don't block */
+    if(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1)
+        perror("fcntl");
+
     s->listenfd = fd;
 
-    /* now setup hints for the connecting socket */
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
+    /* the servers are a comma-separated list */
+    char list[strlen(net->servers) + 1];
+    char *server, *saveptr;
 
-    if((n = getaddrinfo(server, serverport, &hints, &servinfo))) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(n));
+    init_pool(&(s->pool));
+    strcpy(list, net->servers);
+    for(server = strtok_r(list, ",", &saveptr); server;
+            server = strtok_r(NULL, ",", &saveptr))
+        add_upstream(&(s->pool), server, net->port);
+
+    if(s->pool.n == 0) {
+        fprintf(stderr, "error: no servers to connect to for %s\n",
+                net->name);
         exit(1);
     }
 
-    /* find a working connection */
-    for(p = servinfo; p; p = p->ai_next) {
-        if((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
-            perror("socket");
-            continue;
-        }
+    if(net->serverpass)
+        s->upstream_pass = strdup(net->serverpass);
+    s->username = strdup(net->username);
+    s->realname = strdup(net->realname);
 
-        if(connect(fd, p->ai_addr, p->ai_addrlen) == -1) {
-            close(fd);
-            perror("connect");
-            continue;
-        }
+    start_probes(&(s->pool));
 
-        /* successfully socket'd and connect'd, use this fd */
-        break;
-    }
+    /* clients can connect while we wait to try the server again */
+    if(connect_server(s) != 0)
+        wait_reconnect(s);
+}
 
-    freeaddrinfo(servinfo);
+/* send the given message to all clients */
+int send_all_clients(Server *s, const Message *m) {
+    send_all_message(s, NULL, m);
+    return 0;
+}
 
-    if(!p) {
-        fprintf(stderr, "error: failed to connect to %s:%s\n",
-                server, serverport);
-        exit(1);
-    }
+/* handle new connections on the listening socket */
+void handle_new_connection(Server *s) {
+    int fd;
+    struct sockaddr_storage addr;
+    socklen_t addrsize;
 
-    s->sock->fd = fd;
+    while(1) {
+        addrsize = sizeof(addr);
+
+        /* if the acceptance fails for some reason, Keep Calm and Carry On */
+        if((fd = accept4(s->listenfd, (struct sockaddr *)&addr,
+                        &addrsize, SOCK_NONBLOCK)) == -1) {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+            return;
+        }
 
-    /* now register with the server */
-    if(serverpass)
-        send_socket_messagev(s->sock, NULL, NULL, NULL, CMD_PASS, serverpass,
-                NULL);
-    send_socket_messagev(s->sock, NULL, NULL, NULL, CMD_NICK, s->nick, NULL);
-    send_socket_messagev(s->sock, NULL, NULL, NULL, CMD_USER, username,
-            "localhost", server, realname, NULL);
+        /* make a new client */
+        Client *c = new_client(s);
+        c->sock.fd = fd;
+
+        if(s->workers) {
+            /* the worker reads from and writes to the client from now on,
+             * and errors it finds come back as deferred events
+             */
+            init_event(&c->sock.ev, handle_client_event, c);
+            c->sock.peer = add_peer(s->workers, &c->sock, c);
+        } else if(add_event(&c->sock.ev, fd, EV_READ | EV_WRITE,
+                    handle_client_event, c)) {
+            close(fd);
+            free_client(c);
+            continue;
+        }
 
-    /* TODO: Something that will reliably cause us to be told our user and
-     * host so that it will get set (send us a pm?). We need to give the
-     * server long enough to decide whether or not our nick is taken though.
-     * Perhaps waiting for any of:
-     *  1.) A 001 (RPL_WELCOME) message (success)
-     *  2.) 5 seconds to pass (assume success)
-     *  3.) A 433 (ERR_NICKNAMEINUSE) message (failure)
-     */
+        /* automatically authenticate if there is no password */
+        if(!s->pass)
+            c->authd = 1;
+    }
 }
 
-/* send the given message to all clients */
-int send_all_clients(Server *s, const Message *m) {
+/* write the state of the server and all of its clients to stderr */
+void dump_server_stats(Server *s) {
     Client *c;
-    size_t msglen;
-    char *strmsg = strmessage(m, &msglen);
+    int h = 0;
 
-    for(c = s->client_list; c; c = c->next)
-        send_socket_string(c->sock, strmsg, msglen);
+    fprintf(stderr, "network %s, server %s: fd %d, %zu bytes queued in %d "
+            "buffers, %d reconnects, %ld lines passed through\n", s->name,
+            s->nick, s->sock->fd, s->sock->outq.bytes, s->sock->outq.nnodes,
+            s->reconnects, s->passed);
 
-    free(strmsg);
+    dump_pool_stats(&(s->pool));
+    dump_sched_stats(&(s->sched));
+    dump_request_stats(s);
 
-    return 0;
+    while((c = next_client(s, &h)))
+        dump_client_stats(c);
 }
 
-/* handle a new connection on the listening socket */
-void handle_new_connection(Server *s) {
-    int fd;
-    struct sockaddr_storage addr;
-    socklen_t addrsize = sizeof(addr);
+/* forward a line from the server to all of the clients exactly as it was
+ * sent (apart from its tags, which clients haven't asked for) if nothing
+ * needs to look inside it: it is a command with no handler, it can't be part
+ * of a labelled reply, we already know our own prefix, and it isn't a NOTICE
+ * in a burst that clients may have already seen (which depends on who sent
+ * it); this is most of what the server sends, e.g. PRIVMSG and NOTICE
+ * return 0 if the line was forwarded and -1 if it needs handling as normal
+ */
+static int pass_through(Server *s, char *line, size_t len) {
+    const char *body;
+    int command = peek_command(line, &body);
+
+    if(command < CMD_INVALID || command >= NCOMMANDS
+            || message_handler[command] || s->label_head || !s->user
+            || !s->gothost
+            || (s->bursting && s->reconnects && command == CMD_NOTICE))
+        return -1;
 
-    /* if the acceptance fails for some reason, Keep Calm and Carry On */
-    if((fd = accept(s->listenfd, (struct sockaddr *)&addr, &addrsize)) == -1) {
-        perror("accept");
-        return;
-    }
+    len -= body - line;
 
-    /* make a new client and add him to the list */
-    Client *c = new_client();
-    c->sock->fd = fd;
-    c->server = s;
+    Buffer *buf = new_buffer(len + 2);
+    memcpy(buf->data, body, len);
+    memcpy(buf->data + len, "\r\n", 2);
+    buf->len = len + 2;
 
-    /* automatically authenticate if there is no password */
-    if(!s->pass)
-        c->authd = 1;
+    send_all_buffer(s, NULL, buf);
+    free_buffer(buf);
 
-    prepend_client(c, &(s->client_list));
+    s->passed++;
+    return 0;
 }
 
 /* handle data from the server by splitting it up and handling any lines that
  * are received
  */
 void handle_server_data(Server *s) {
-    /* read data into the buffer and handle messages if there is no error */
-    if(read_data(s->sock) == 0)
-        handle_messages(s->sock, (GenericMessageHandler)handle_server_message,
-                s);
+    /* read until there is nothing left, handling messages as we go */
+    while(!s->sock->error && read_data(s->sock) > 0)
+        handle_raw_messages(s->sock, (RawMessageHandler)pass_through,
+                (GenericMessageHandler)handle_server_message, s);
+
+    shrink_socket_buffer(s->sock);
 }
 
 /* handle a message from the server (ignore any invalid ones) */
@@ -238,8 +545,7 @@ int handle_server_message(Server *s, const Message *m) {
     /* set the user and host of the server state if it doesn't already
      * have one and the message does
      */
-    if((!s->user || !s->gothost) && m->nick && s->nick
-            && strcasecmp(m->nick, s->nick) == 0) {
+    if((!s->user || !s->gothost) && m->nick && is_us(s, m->nick)) {
         if(m->user)
             s->user = strdup(m->user);
         if(m->host) {
@@ -249,15 +555,51 @@ int handle_server_message(Server *s, const Message *m) {
         }
     }
 
+    /* replies to requests are handled as normal, but only go to the clients
+     * that asked
+     */
+    s->reply = reply_request(s, m);
+
+    /* clients haven't negotiated any capabilities, so don't give them tags
+     * now that they have been used for routing
+     */
+    Message untagged = *m;
+    untagged.tags = NULL;
+    m = &untagged;
+
+    int r = 0;
+
     /* call the handler if there is one, otherwise just ignore the message */
     if(m->command >= 0 && m->command < NCOMMANDS
             && message_handler[m->command]) {
-        return message_handler[m->command](s, m);
+        r = message_handler[m->command](s, m);
+    } else if(!s->reply && m->command < CMD_INVALID && !(s->caps & CAP_LABELS)
+            && s->last_client && time(NULL) - s->last_sent < REPLY_GUESS_TIME) {
+        /* without labels, a numeric nobody else wanted is most likely the
+         * reply to whatever a client sent last
+         */
+        send_socket_message(&s->last_client->sock, m);
+    } else if(!s->reply && s->bursting && s->reconnects
+            && (m->command < CMD_INVALID
+                || (m->command == CMD_NOTICE && !m->user))) {
+        /* clients saw the numerics and the server's own notices when we
+         * first connected, but messages from users (e.g. NickServ) are new
+         */
     } else {
         /* pass un-handled messages to all clients */
         send_all_clients(s, m);
-        return 0;
     }
+
+    if(s->reply)
+        end_reply(s, m);
+
+    /* the MOTD is the last thing the server sends unasked after we connect */
+    if(m->command == RPL_ENDOFMOTD || m->command == ERR_NOMOTD) {
+        s->bursting = 0;
+        send_requests(s);
+    }
+
+    return r;
 }
 
 /* ignore this message */
@@ -265,6 +607,67 @@ static int handle_ignore(Server *s, const Message *m) {
     return 0;
 }
 
+/* return 1 if the space-separated list of capabilities (which may have
+ * values after an '=') contains cap
+ */
+static int has_cap(const char *list, const char *cap) {
+    size_t n = strlen(cap);
+    const char *p = list;
+
+    while((p = strstr(p, cap))) {
+        if((p == list || p[-1] == ' ')
+                && (p[n] == '\0' || p[n] == ' ' || p[n] == '='))
+            return 1;
+        p += n;
+    }
+
+    return 0;
+}
+
+/* handle a CAP message by asking for the capabilities we want if the server
+ * has them, and ending negotiation when it has answered
+ */
+static int handle_cap(Server *s, const Message *m) {
+    if(m->nparams < 3)
+        return -1;
+
+    const char *sub = m->param[1];
+    const char *list = m->param[m->nparams - 1];
+
+    if(strcmp(sub, "LS") == 0) {
+        /* while listing, caps says what the server has */
+        if(has_cap(list, "batch"))
+            s->caps |= CAP_BATCH;
+        if(has_cap(list, "labeled-response"))
+            s->caps |= CAP_LABELS;
+
+        /* a "*" before the list means there are more lines to come */
+        if(m->nparams > 3 && strcmp(m->param[2], "*") == 0)
+            return 0;
+
+        /* labels are only any use with batches for multi-line replies */
+        if(s->caps == (CAP_BATCH | CAP_LABELS)) {
+            s->caps = 0;
+            return send_server_messagev(s, LANE_URGENT, CMD_CAP, "REQ",
+                    "batch labeled-response", NULL);
+        }
+        s->caps = 0;
+    } else if(strcmp(sub, "ACK") == 0) {
+        if(has_cap(list, "batch"))
+            s->caps |= CAP_BATCH;
+        if(has_cap(list, "labeled-response"))
+            s->caps |= CAP_LABELS;
+    } else if(strcmp(sub, "DEL") == 0) {
+        if(has_cap(list, "batch") || has_cap(list, "labeled-response"))
+            s->caps = 0;
+        return 0;
+    } else if(strcmp(sub, "NAK") != 0) {
+        return 0;
+    }
+
+    return send_server_messagev(s, LANE_URGENT, CMD_CAP, "END", NULL);
+}
+
 /* handle a join message by telling all clients about the join, and joining it
  * if the joiner is us; return 0 on success and -1 on error
  */
@@ -273,11 +676,43 @@ static int handle_join(Server *s, const Message *m) {
     if(!m->nick || m->nparams == 0)
         return -1;
 
-    if(strcasecmp(m->nick, s->nick) == 0) {
-        joined_channel(s, m->param[0]);
+    int us = is_us(s, m->nick);
+
+    /* servers may join several channels in one message; clients already
+     * think we are in the ones we are rejoining
+     */
+    char channels[strlen(m->param[0]) + 1];
+    char fresh[strlen(m->param[0]) + 1];
+    char *channel, *saveptr;
+    char *endptr = NULL;
+
+    *fresh = '\0';
+    strcpy(channels, m->param[0]);
+    for(channel = strtok_r(channels, ",", &saveptr); channel;
+            channel = strtok_r(NULL, ",", &saveptr)) {
+        Channel *chan = lookup_channel(s, channel);
+
+        if(us) {
+            int again = chan && chan->rejoin_state == REJOIN_WAITING;
+            joined_channel(s, channel);
+            if(again)
+                continue;
+        } else if(chan) {
+            add_member(s, chan, m->nick);
+        }
+
+        if(*fresh)
+            strappend(fresh, &endptr, sizeof(fresh), ",");
+        strappend(fresh, &endptr, sizeof(fresh), channel);
     }
 
-    send_all_message(s, NULL, m);
+    if(strcmp(fresh, m->param[0]) == 0) {
+        send_all_message(s, NULL, m);
+    } else if(*fresh) {
+        Message join = *m;
+        join.param[0] = fresh;
+        send_all_message(s, NULL, &join);
+    }
 
     return 0;
 }
@@ -290,8 +725,42 @@ static int handle_part(Server *s, const Message *m) {
     if(!m->nick || m->nparams == 0)
         return -1;
 
-    if(strcasecmp(m->nick, s->nick) == 0) {
+    int us = is_us(s, m->nick);
+
+    /* servers may part several channels in one message */
+    char channels[strlen(m->param[0]) + 1];
+    char *channel, *saveptr;
+
+    strcpy(channels, m->param[0]);
+    for(channel = strtok_r(channels, ",", &saveptr); channel;
+            channel = strtok_r(NULL, ",", &saveptr)) {
+        if(us) {
+            parted_channel(s, channel);
+        } else {
+            Channel *chan = lookup_channel(s, channel);
+            if(chan)
+                remove_member(s, chan, m->nick);
+        }
+    }
+
+    send_all_message(s, NULL, m);
+
+    return 0;
+}
+
+/* handle a kick message by telling all clients about it, and forgetting
+ * about the channel if it was us that was kicked
+ */
+static int handle_kick(Server *s, const Message *m) {
+    if(m->nparams < 2)
+        return -1;
+
+    if(is_us(s, m->param[1])) {
         parted_channel(s, m->param[0]);
+    } else {
+        Channel *chan = lookup_channel(s, m->param[0]);
+        if(chan)
+            remove_member(s, chan, m->param[1]);
     }
 
     send_all_message(s, NULL, m);
@@ -299,6 +768,20 @@ static int handle_part(Server *s, const Message *m) {
     return 0;
 }
 
+/* handle a quit message by removing the user from every channel and telling
+ * all clients
+ */
+static int handle_quit(Server *s, const Message *m) {
+    if(!m->nick)
+        return -1;
+
+    quit_member(s, m->nick);
+
+    send_all_message(s, NULL, m);
+
+    return 0;
+}
+
 /* handle a nick message by telling all clients about the nick, and changing
  * our nick if the old one was us
  */
@@ -312,47 +795,170 @@ static int handle_nick(Server *s, const Message *m) {
      */
     send_all_clients(s, m);
 
+    int us = is_us(s, m->nick);
+
+    /* cached replies are addressed to our old nick */
+    if(us && strcmp(s->nick, m->param[0]) != 0)
+        flush_cache(s);
+
+    rename_member(s, m->nick, m->param[0]);
+
     /* if the nick change is for us, update our nick */
-    if(strcasecmp(m->nick, s->nick) == 0) {
-        free(s->nick);
-        s->nick = strdup(m->param[0]);
+    if(us) {
+        set_nick(s, m->param[0]);
 
-        /* also change all of the welcome message nicks */
-        /* TODO: it is pretty inefficient to keep around hundreds of copies of
-         * the nick...
+        /* clients that attach from now on need the welcome messages with
+         * the new nick
          */
-        int i;
-        for(i = 0; i < s->nwelcomes; i++) {
-            if(s->welcomemsg[i]->nparams > 0) {
-                free(s->welcomemsg[i]->param[0]);
-                s->welcomemsg[i]->param[0] = strdup(s->nick);
+        if(s->welcome) {
+            free_buffer(s->welcome);
+            s->welcome = NULL;
+        }
+    }
+
+    return 0;
+}
+
+/* handle a mode change by keeping track of channel members' prefix modes
+ * and telling all clients
+ */
+static int handle_mode(Server *s, const Message *m) {
+    Channel *chan;
+
+    if(m->nparams >= 2 && (chan = lookup_channel(s, m->param[0]))) {
+        const char *mode;
+        int arg = 2;
+        int set = 1;
+
+        for(mode = m->param[1]; *mode; mode++) {
+            if(*mode == '+' || *mode == '-') {
+                set = *mode == '+';
+                continue;
+            }
+
+            /* work out whether this mode takes an argument: prefix modes
+             * and list modes (type A) and type B always do, type C only
+             * when being set, and type D never
+             */
+            if(strchr(s->prefix_modes, *mode)) {
+                if(arg < m->nparams)
+                    set_member_mode(s, chan, m->param[arg], *mode, set);
+                arg++;
+            } else if(strchr(s->chanmodes[0], *mode)
+                    || strchr(s->chanmodes[1], *mode)
+                    || (set && strchr(s->chanmodes[2], *mode))) {
+                /* the key is needed to join again after reconnecting */
+                if(*mode == 'k' && arg < m->nparams)
+                    set_channel_key(chan, set ? m->param[arg] : NULL);
+                arg++;
             }
         }
     }
 
+    send_all_clients(s, m);
+
     return 0;
 }
 
-/* handle a topic change */
+/* handle RPL_NAMREPLY and RPL_ENDOFNAMES by keeping track of the members of
+ * the channel and passing them on to all clients
+ */
+static int handle_names(Server *s, const Message *m) {
+    Channel *chan = NULL;
+
+    if(m->command == RPL_NAMREPLY && m->nparams >= 4
+            && (chan = lookup_channel(s, m->param[2]))) {
+        /* the first reply replaces whatever we knew before */
+        if(chan->names_state != NAMES_READING) {
+            clear_members(s, chan);
+            chan->names_state = NAMES_READING;
+        }
+
+        chan->symbol = m->param[1][0];
+
+        /* the names are space-separated in the last parameter */
+        char names[strlen(m->param[3]) + 1];
+        char *name, *saveptr;
+
+        strcpy(names, m->param[3]);
+        for(name = strtok_r(names, " ", &saveptr); name;
+                name = strtok_r(NULL, " ", &saveptr))
+            add_member(s, chan, name);
+    } else if(m->command == RPL_ENDOFNAMES && m->nparams >= 2
+            && (chan = lookup_channel(s, m->param[1]))) {
+        if(chan->names_state == NAMES_READING)
+            chan->names_state = NAMES_HAVE;
+
+        /* servers send the topic before the names when we join, and send
+         * nothing at all if there is no topic
+         */
+        if(!chan->gottopic)
+            set_topic(chan, "");
+    }
+
+    /* clients already know who was in a channel we have rejoined, so they
+     * are only told what has changed
+     */
+    if(chan && chan->rejoin_state == REJOIN_READING && !s->reply) {
+        if(m->command == RPL_ENDOFNAMES)
+            rejoined_channel(s, chan);
+        return 0;
+    }
+
+    send_all_clients(s, m);
+
+    return 0;
+}
+
+/* handle a topic change or topic numeric by updating what we know about the
+ * channel topic, and telling all clients
+ */
 static int handle_topic(Server *s, const Message *m) {
+    int needed = m->command == RPL_TOPICWHOTIME ? 4
+        : m->command == RPL_NOTOPIC ? 2 : 3;
+
     /* not enough parameters: fail */
-    if((m->command != CMD_TOPIC && m->nparams < 3) || m->nparams < 2)
+    if(m->command == CMD_TOPIC ? m->nparams < 2 : m->nparams < needed)
         return -1;
 
     /* if this is a numeric topic message, there is an extra parameter
      * containing our nick
      */
-    char **param = m->param + (m->command != CMD_TOPIC);
-
-    Channel *chan = lookup_channel(s->channel_list, param[0]);
-
-    /* not in the channel: fail */
-    if(!chan)
-        return -1;
+    const char * const *param = m->param + (m->command != CMD_TOPIC);
+
+    Channel *chan = lookup_channel(s, param[0]);
+
+    if(chan) {
+        switch(m->command) {
+        case CMD_TOPIC:
+            /* someone changed it just now */
+            set_topic(chan, param[1]);
+            if(m->nick) {
+                char setter[512];
+                snprintf(setter, sizeof(setter), "%s%s%s%s%s", m->nick,
+                        m->user ? "!" : "", m->user ? m->user : "",
+                        m->host ? "@" : "", m->host ? m->host : "");
+                set_topic_setter(chan, setter, time(NULL));
+            }
+            break;
+        case RPL_NOTOPIC:
+            set_topic(chan, "");
+            break;
+        case RPL_TOPIC:
+            set_topic(chan, param[1]);
+            break;
+        case RPL_TOPICWHOTIME:
+            set_topic_setter(chan, param[1], atol(param[2]));
+            break;
+        }
 
-    /* update the topic */
-    free(chan->topic);
-    chan->topic = strdup(param[1]);
+        /* the topic of a channel we have rejoined is compared with the old
+         * one once the names have come
+         */
+        if(chan->rejoin_state == REJOIN_READING && m->command != CMD_TOPIC
+                && !s->reply)
+            return 0;
+    }
 
     /* tell all clients */
     send_all_message(s, NULL, m);
@@ -362,53 +968,230 @@ static int handle_topic(Server *s, const Message *m) {
 
 /* handle a PING by replying */
 static int handle_ping(Server *s, const Message *m) {
-    Message *pong = copy_message(m);
-    pong->command = CMD_PONG;
+    Message pong = *m;
+    pong.command = CMD_PONG;
 
-    send_socket_message(s->sock, pong);
+    return send_server_message(s, LANE_URGENT, &pong);
+}
 
-    free_message(pong);
+/* handle a PONG by passing it on, unless it marks the end of the reply to a
+ * request
+ */
+static int handle_pong(Server *s, const Message *m) {
+    if(end_request(s, m))
+        return 0;
 
-    return 0;
+    /* our own PING, which tells us how quickly the server answers */
+    if(m->nparams >= 1 && strcmp(m->param[m->nparams - 1], PING_TOKEN) == 0) {
+        if(s->pingsent)
+            upstream_ping(s->pool.up + s->pool.current,
+                    event_time() - s->pingsent);
+        s->pingsent = 0;
+        return 0;
+    }
+
+    return send_all_clients(s, m);
 }
 
-/* handle a welcome message by appending it to the buffer and sending it to
- * any existing clients
+/* take note of a KEY=VALUE token from an RPL_ISUPPORT message */
+static void handle_isupport_token(Server *s, const char *token) {
+    if(strncmp(token, "CASEMAPPING=", 12) == 0) {
+        s->casemapping = parse_casemapping(token + 12);
+        table_set_casemap(&(s->channels), s->casemapping);
+        set_names_casemap(&(s->names), s->casemapping);
+        set_channel_casemap(s, s->casemapping);
+    } else if(strncmp(token, "PREFIX=", 7) == 0) {
+        /* PREFIX=(modes)prefixes, e.g. PREFIX=(ov)@+ */
+        const char *modes = token + 7;
+        const char *end = strchr(modes, ')');
+        size_t n = end ? end - modes - 1 : 0;
+
+        if(*modes == '(' && end && strlen(end + 1) == n) {
+            free(s->prefix_modes);
+            free(s->prefix_chars);
+            s->prefix_modes = strprefix(modes + 1, n);
+            s->prefix_chars = strdup(end + 1);
+        } else if(*modes == '\0') {
+            free(s->prefix_modes);
+            free(s->prefix_chars);
+            s->prefix_modes = strdup("");
+            s->prefix_chars = strdup("");
+        }
+    } else if(strncmp(token, "CHANMODES=", 10) == 0) {
+        /* CHANMODES=A,B,C,D */
+        const char *p = token + 10;
+        int i;
+
+        for(i = 0; i < 4; i++) {
+            size_t n = strcspn(p, ",");
+            free(s->chanmodes[i]);
+            s->chanmodes[i] = strprefix(p, n);
+            p += n + (p[n] == ',');
+        }
+    }
+}
+
+/* forget the welcome messages of the last connection */
+static void clear_welcome(Server *s) {
+    free(s->welcometext);
+    free(s->welcomeline);
+    if(s->welcome)
+        free_buffer(s->welcome);
+
+    s->welcometext = NULL;
+    s->welcomelen = 0;
+    s->welcomeline = NULL;
+    s->nwelcomes = 0;
+    s->welcome = NULL;
+}
+
+/* keep the welcome message for clients that attach later, as a template
+ * that our nick (its first parameter) can be put into; the tags are left
+ * out, as clients haven't asked for them
  */
-static int handle_welcome(Server *s, const Message *m) {
-    s->nwelcomes++;
-    s->welcomemsg = realloc(s->welcomemsg, s->nwelcomes * sizeof(Message *));
-    s->welcomemsg[s->nwelcomes - 1] = copy_message(m);
+static void add_welcome(Server *s, const Message *m) {
+    Message t = *m;
+    char line[MESSAGE_SIZE];
+    ssize_t slot = -1;
+    WelcomeLine *l;
 
-    send_all_clients(s, m);
+    t.tags = NULL;
 
-    return 0;
+    /* the nick goes where the first parameter starts, just after the
+     * command and its space
+     */
+    if(t.nparams > 0) {
+        t.nparams = 0;
+        slot = write_message(&t, line) - 1;
+        t.nparams = m->nparams;
+        t.param[0] = "";
+    }
+
+    size_t len = write_message(&t, line) - 2;
+
+    if(s->welcomelen + len > WELCOME_MAX)
+        return;
+    if(slot > (ssize_t)len)
+        slot = len;
+
+    s->welcomeline = realloc(s->welcomeline,
+            (s->nwelcomes + 1) * sizeof(WelcomeLine));
+    l = s->welcomeline + s->nwelcomes++;
+    l->len = len;
+    l->slot = slot;
+
+    s->welcometext = realloc(s->welcometext, s->welcomelen + len);
+    memcpy(s->welcometext + s->welcomelen, line, len);
+    s->welcomelen += len;
+
+    if(s->welcome) {
+        free_buffer(s->welcome);
+        s->welcome = NULL;
+    }
 }
 
-/* handle motd-related messages by forwarding them to appropriate clients */
-static int handle_motd(Server *s, const Message *m) {
-    Client *c;
+/* return a buffer of all of the welcome messages, addressed to our current
+ * nick, to be sent to a client as it attaches; it is only made again after
+ * something changes, and the caller doesn't get a reference of its own
+ */
+Buffer *welcome_buffer(Server *s) {
+    size_t nicklen = strlen(s->nick), off = 0;
+    char *p;
+    int i;
 
-    for(c = s->client_list; c; c = c->next) {
-        if(s->motd_state == MOTD_HAPPY
-                || (s->motd_state == MOTD_WANT && c->motd_state == MOTD_WANT)
-                || (c->motd_state == MOTD_READING)) {
-            /* update the client motd state */
-            if(c->motd_state == MOTD_WANT)
-                c->motd_state = MOTD_READING;
-            if(m->command == RPL_ENDOFMOTD)
-                c->motd_state = MOTD_HAPPY;
-
-            /* forward the message */
-            send_socket_message(c->sock, m);
+    if(s->welcome)
+        return s->welcome;
+
+    s->welcome = new_buffer(s->welcomelen + s->nwelcomes * (nicklen + 2));
+    p = s->welcome->data;
+
+    for(i = 0; i < s->nwelcomes; i++) {
+        const WelcomeLine *l = s->welcomeline + i;
+        const char *text = s->welcometext + off;
+        char *start = p;
+
+        if(l->slot < 0) {
+            memcpy(p, text, l->len);
+            p += l->len;
+        } else {
+            memcpy(p, text, l->slot);
+            p += l->slot;
+            memcpy(p, s->nick, nicklen);
+            p += nicklen;
+            memcpy(p, text + l->slot, l->len - l->slot);
+            p += l->len - l->slot;
         }
+
+        /* a longer nick mustn't make the line too long */
+        if(p - start > MESSAGE_SIZE - 3)
+            p = start + MESSAGE_SIZE - 3;
+        memcpy(p, "\r\n", 2);
+        p += 2;
+
+        off += l->len;
     }
 
-    /* update the server motd state */
-    if(s->motd_state == MOTD_WANT)
-        s->motd_state = MOTD_READING;
-    if(m->command == RPL_ENDOFMOTD)
-        s->motd_state = MOTD_HAPPY;
+    s->welcome->len = p - s->welcome->data;
+
+    return s->welcome;
+}
+
+/* handle a welcome message by keeping it for clients that attach later and
+ * sending it to any existing clients
+ */
+static int handle_welcome(Server *s, const Message *m) {
+    /* a reply to a request (e.g. the RPL_ISUPPORT lines of VERSION) is only
+     * for the clients that asked, and may describe another server
+     */
+    if(s->reply)
+        return send_all_clients(s, m);
+
+    /* the first parameter is our nick and the last is "are supported by this
+     * server" or similar
+     */
+    if(m->command == RPL_ISUPPORT) {
+        int i;
+        for(i = 1; i < m->nparams - 1; i++)
+            handle_isupport_token(s, m->param[i]);
+    }
+
+    if(m->command == RPL_WELCOME) {
+        /* this is a new connection, with new welcome messages */
+        clear_welcome(s);
+
+        s->registered = 1;
+        s->backoff = 0;
+        add_timer(&(s->pingtimer), PING_INTERVAL, handle_ping_timer, s);
+
+        /* numerics we make up for clients come from the server's name */
+        if(m->nick) {
+            free(s->servername);
+            s->servername = strdup(m->nick);
+        }
+
+        /* we may not have got the nick we asked for */
+        if(m->nparams > 0 && strcmp(m->param[0], s->nick) != 0) {
+            Message nick;
+            memset(&nick, 0, sizeof(Message));
+            nick.nick = s->nick;
+            nick.user = s->user;
+            nick.host = s->host;
+            nick.command = CMD_NICK;
+            add_message_param(&nick, m->param[0]);
+            handle_nick(s, &nick);
+        }
+    }
+
+    add_welcome(s, m);
+
+    /* after reconnecting, clients have seen the welcome messages before */
+    if(!s->reconnects) {
+        send_all_clients(s, m);
+    } else if(m->command == RPL_WELCOME) {
+        send_all_messagev(s, NULL, s->servername, NULL, NULL, CMD_NOTICE,
+                s->nick, "muxirc: reconnected to the server", NULL);
+        rejoin_channels(s);
+    }
 
     return 0;
 }
@@ -416,29 +1199,108 @@ static int handle_motd(Server *s, const Message *m) {
 /* change to a random nick */
 static int handle_nickinuse(Server *s, const Message *m) {
     /* if there are clients, let them deal with it */
-    if(s->client_list)
+    if(s->nclients && s->registered)
         return send_all_clients(s, m);
 
+    /* when registering again, stay close to the nick the clients know */
+    if(s->reconnects && m->nparams >= 2 && strlen(m->param[1]) < 16) {
+        char nick[strlen(m->param[1]) + 2];
+        sprintf(nick, "%s_", m->param[1]);
+        return send_server_messagev(s, LANE_URGENT, CMD_NICK, nick, NULL);
+    }
+
     /* otherwise, choose a random nick */
-    return send_socket_messagev(s->sock, NULL, NULL, NULL, CMD_NICK,
-            random_nick(), NULL);
+    return send_server_messagev(s, LANE_URGENT, CMD_NICK, random_nick(),
+            NULL);
+}
+
+/* handle the server refusing to let us join a channel by forgetting about
+ * it, telling clients that we have left it if they thought we were in it
+ */
+static int handle_joinfail(Server *s, const Message *m) {
+    Channel *chan;
+
+    if(m->nparams >= 2 && (chan = lookup_channel(s, m->param[1]))
+            && (chan->state == CHAN_JOINING
+                || chan->rejoin_state == REJOIN_WAITING)) {
+        if(chan->rejoin_state == REJOIN_WAITING)
+            send_all_messagev(s, NULL, s->nick, s->user, s->host, CMD_PART,
+                    chan->name, m->param[m->nparams - 1], NULL);
+        parted_channel(s, m->param[1]);
+    }
+
+    return send_all_clients(s, m);
+}
+
+/* send a message to the server through the given lane of the scheduler, so
+ * that we don't get disconnected for flooding
+ */
+int send_server_message(Server *s, int lane, const Message *m) {
+    char line[message_size(m)];
+
+    return sched_string(&(s->sched), lane, line, write_message(m, line));
+}
+
+/* send a message to the server through the given lane of the scheduler, in
+ * the form:
+ *  <command> <params...>
+ */
+int send_server_messagev(Server *s, int lane, int command, ...) {
+    va_list argp;
+    char line[MESSAGE_SIZE];
+    size_t len;
+
+    va_start(argp, command);
+    len = write_messagev(line, NULL, NULL, NULL, command, argp);
+    va_end(argp);
+
+    return sched_string(&(s->sched), lane, line, len);
+}
+
+/* send a reference to the buffer to all clients, so that however many
+ * clients there are it only exists once
+ */
+void send_all_buffer(Server *s, Client *except, Buffer *buf) {
+    Client *c;
+    int h = 0;
+
+    while((c = next_client(s, &h)))
+        if(c != except)
+            send_socket_buffer(&c->sock, buf);
 }
 
 /* send a string to all clients */
 void send_all_string(Server *s, Client *except, const char *str,
         ssize_t len) {
-    Client *c;
-    for(c = s->client_list; c; c = c->next)
-        if(c != except)
-            send_socket_string(c->sock, str, len);
+    if(len < 0)
+        len = strlen(str);
+
+    Buffer *buf = new_buffer(len);
+    memcpy(buf->data, str, len);
+    buf->len = len;
+
+    send_all_buffer(s, except, buf);
+    free_buffer(buf);
+}
+
+/* send the buffer to all clients; while handling a reply to a request, "all
+ * clients" means the clients that asked
+ */
+static void send_all_reply(Server *s, Client *except, Buffer *buf) {
+    if(s->reply)
+        send_reply(s, buf);
+    else
+        send_all_buffer(s, except, buf);
 }
 
-/* send a message to all clients */
+/* send a message to all clients, serialising it only once; while handling a
+ * reply to a request, "all clients" means the clients that asked
+ */
 void send_all_message(Server *s, Client *except, const Message *m) {
-    size_t msglen;
-    char *strmsg = strmessage(m, &msglen);
+    Buffer *buf = message_buffer(m);
 
-    send_all_string(s, except, strmsg, msglen);
+    send_all_reply(s, except, buf);
+    free_buffer(buf);
 }
 
 /* send a message to all clients, in the form:
@@ -447,29 +1309,12 @@ void send_all_message(Server *s, Client *except, const Message *m) {
 void send_all_messagev(Server *s, Client *except, const char *nick,
         const char *user, const char *host, int command, ...) {
     va_list argp;
-    Message *m = new_message();
-
-    if(nick)
-        m->nick = strdup(nick);
-    if(user)
-        m->user = strdup(user);
-    if(host)
-        m->host = strdup(host);
-    m->command = command;
+    Buffer *buf = new_buffer(MESSAGE_SIZE);
 
     va_start(argp, command);
-
-    char *str;
-    while(1) {
-        str = va_arg(argp, char *);
-        if(!str)
-            break;
-
-        add_message_param(m, strdup(str));
-    }
-
+    buf->len = write_messagev(buf->data, nick, user, host, command, argp);
     va_end(argp);
 
-    send_all_message(s, except, m);
-    free_message(m);
+    send_all_reply(s, except, buf);
+    free_buffer(buf);
 }
@@ -6,28 +6,108 @@
 #ifndef STATE_H_INC
 #define STATE_H_INC
 
+/* after losing the server, wait this many milliseconds before connecting
+ * again, doubling the wait after each failure up to RECONNECT_MAX
+ */
+#define RECONNECT_MIN 1000
+#define RECONNECT_MAX (5 * 60 * 1000)
+
+/* the server is sent a PING with this token this often, to see how quickly
+ * it answers; if the last one hasn't been answered by the time the next is
+ * due, the connection is given up on
+ */
+#define PING_TOKEN "muxirc-rtt"
+#define PING_INTERVAL (60 * 1000)
+
+/* at most this many bytes of welcome messages are kept for clients that
+ * attach later; any more are only sent to the clients already attached
+ */
+#define WELCOME_MAX 8192
+
+/* a welcome message as the template for clients' copies: len bytes of it
+ * (without \r\n) are in Server.welcometext, and our nick goes slot bytes
+ * into it, unless slot is -1
+ */
+typedef struct WelcomeLine {
+    size_t len;
+    ssize_t slot;
+} WelcomeLine;
+
 typedef struct Server {
+    char *name;
+    struct Workers *workers;
     int listenfd;
-    int motd_state;
+    Event listenev;
+    /* our nick, which is the string of our Name in names */
     char *nick;
+    struct Name *me;
+    Table names;
     char *user;
     int gothost;
     char *host;
     char *pass;
+    char *welcometext;
+    size_t welcomelen;
     int nwelcomes;
-    Message **welcomemsg;
+    WelcomeLine *welcomeline;
+    Buffer *welcome;
+    char *servername;
+    int casemapping;
+    char *prefix_modes;
+    char *prefix_chars;
+    char *chanmodes[4];
     struct Socket *sock;
-    struct Channel *channel_list;
-    struct Client *client_list;
+    Pool pool;
+    char *upstream_pass;
+    char *username, *realname;
+    int registered;
+    int bursting;
+    int reconnects;
+    long passed;
+    long backoff;
+    Timer reconnect;
+    Connector connector;
+    Timer pingtimer;
+    long pingsent;
+    Sched sched;
+    Slab channel_slab;
+    int *channel_order;
+    int nordered, orderroom;
+    Table channels;
+    char joins[512], keyed[512], keys[512], parts[512];
+    char *partreason;
+    Timer chantimer;
+    Slab client_slab;
+    int nclients;
+    struct Request *request_head, *request_tail;
+    unsigned next_fence;
+    struct Request *reply;
+    struct Request *motd;
+    int caps;
+    unsigned next_label;
+    struct Request *label_head, *label_tail;
+    struct Client *last_client;
+    long last_sent;
+    Table cache;
+    struct Request *cache_head, *cache_tail;
+    size_t cache_bytes;
 } Server;
 
+/* IRCv3 capabilities we use when the server has them */
+enum {
+    CAP_BATCH=1, CAP_LABELS=2
+};
+
 void init_server_handlers(void);
-void irc_connect(Server *s, const char *server, const char *serverport,
-        const char *serverpass, const char *username, const char *realname,
-        const char *listenport, const char *pass);
+void irc_connect(Server *s, const struct Network *net);
 void handle_new_connection(Server *s);
+void dump_server_stats(Server *s);
+Buffer *welcome_buffer(Server *s);
 void handle_server_data(Server *s);
 int handle_server_message(Server *s, const struct Message *m);
+int send_server_message(Server *s, int lane, const struct Message *m);
+int send_server_messagev(Server *s, int lane, int command, ...);
+void send_all_buffer(Server *s, Client *except, Buffer *buf);
 void send_all_string(Server *s, Client *except, const char *str,
         ssize_t len);
 void send_all_message(Server *s, Client *except, const Message *m);
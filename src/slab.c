@@ -0,0 +1,91 @@
+/* Slab allocation for muxirc
+ *
+ * Clients and channels are kept in slabs: blocks of SLAB_BLOCK items side by
+ * side, so that going through all of a server's clients (as every line sent
+ * to all of them does) reads memory in order rather than following pointers
+ * around the heap. A freed item's handle goes on a free list, kept in the
+ * item itself, and is handed out again before the slab grows, so clients
+ * coming and going don't touch the allocator.
+ *
+ * James Stanley 2012
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slab.h"
+
+/* initialise an empty slab of items of the given size */
+void init_slab(Slab *s, size_t size) {
+    memset(s, 0, sizeof(Slab));
+    s->size = size < sizeof(int) ? sizeof(int) : size;
+    s->free = -1;
+}
+
+/* return the item with handle h */
+void *slab_item(const Slab *s, int h) {
+    return s->block[h / SLAB_BLOCK] + (size_t)(h % SLAB_BLOCK) * s->size;
+}
+
+/* add another block of items to the slab; there is no way to carry on
+ * without the memory, so give up if there isn't any
+ */
+static void grow_slab(Slab *s) {
+    char **block = realloc(s->block, (s->nblocks + 1) * sizeof(char *));
+    char *live = block ? realloc(s->live, (s->nblocks + 1) * SLAB_BLOCK)
+        : NULL;
+    char *items = live ? malloc(SLAB_BLOCK * s->size) : NULL;
+
+    if(!items) {
+        perror("slab");
+        exit(1);
+    }
+
+    s->block = block;
+    s->live = live;
+    s->block[s->nblocks++] = items;
+}
+
+/* return the handle of a new item, which is zeroed */
+int slab_alloc(Slab *s) {
+    int h;
+
+    if(s->free != -1) {
+        h = s->free;
+        memcpy(&(s->free), slab_item(s, h), sizeof(int));
+    } else {
+        if(s->used == s->nblocks * SLAB_BLOCK)
+            grow_slab(s);
+        h = s->used++;
+    }
+
+    memset(slab_item(s, h), 0, s->size);
+    s->live[h] = 1;
+    s->count++;
+
+    return h;
+}
+
+/* free the item with handle h */
+void slab_free(Slab *s, int h) {
+    memcpy(slab_item(s, h), &(s->free), sizeof(int));
+    s->free = h;
+    s->live[h] = 0;
+    s->count--;
+}
+
+/* return the next item in the slab, starting from handle *h and updating *h
+ * to continue from there next time, or NULL if there are no more; start with
+ * *h = 0; items may be freed while iterating, and items allocated meanwhile
+ * may or may not be returned
+ */
+void *slab_next(const Slab *s, int *h) {
+    while(*h < s->used) {
+        int i = (*h)++;
+        if(s->live[i])
+            return slab_item(s, i);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,31 @@
+/* Slab allocation for muxirc
+ *
+ * James Stanley 2012
+ */
+
+#ifndef SLAB_H_INC
+#define SLAB_H_INC
+
+/* items are allocated this many at a time, in blocks that never move */
+#define SLAB_BLOCK 64
+
+/* items of one size, each known by an int handle; the handles of freed items
+ * are reused before any more memory is allocated
+ */
+typedef struct Slab {
+    size_t size;
+    char **block;
+    int nblocks;
+    char *live;
+    int free;
+    int used;
+    int count;
+} Slab;
+
+void init_slab(Slab *s, size_t size);
+int slab_alloc(Slab *s);
+void *slab_item(const Slab *s, int h);
+void slab_free(Slab *s, int h);
+void *slab_next(const Slab *s, int *h);
+
+#endif
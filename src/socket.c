@@ -8,65 +8,284 @@
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sys/socket.h>
 
+#include "event.h"
+#include "buffer.h"
 #include "socket.h"
+#include "worker.h"
+
+/* the longest line that will be accepted, plus its endline and a nul byte;
+ * IRCv3 allows 8191 bytes of tags on top of the usual 512
+ */
+size_t socket_buffer_limit = 16384;
+
+/* initialise a socket (e.g. one inside something else) for fd -1 */
+void init_socket(Socket *sock) {
+    memset(sock, 0, sizeof(Socket));
+    sock->fd = -1;
+    sock->ev.fd = -1;
+}
 
 /* allocate a socket for fd -1 */
 Socket *new_socket(void) {
     Socket *s = malloc(sizeof(Socket));
-    memset(s, 0, sizeof(Socket));
-    s->fd = -1;
+    init_socket(s);
     return s;
 }
 
-/* send the given string to the given socket, returning -1 on error and 0
- * on success; if len >= 0 it should contain the length of str, otherwise
- * strlen(str) will be used
- * this function updates the socket error state
+/* free anything still waiting to be sent on the socket, but not the socket
+ * itself
+ */
+void clear_socket(Socket *sock) {
+    free_queue(&sock->outq);
+    free(sock->buf);
+    sock->buf = NULL;
+}
+
+/* free the socket and anything still waiting to be sent on it */
+void free_socket(Socket *sock) {
+    clear_socket(sock);
+    free(sock);
+}
+
+/* stop watching the socket, close it, and throw away anything waiting to be
+ * sent or read; it stays in the error state until it is given a new fd
+ */
+void close_socket(Socket *sock) {
+    del_event(&sock->ev);
+
+    if(sock->fd != -1)
+        close(sock->fd);
+    sock->fd = -1;
+    sock->error = -1;
+
+    free_queue(&sock->outq);
+    free(sock->buf);
+    sock->buf = NULL;
+    sock->bytes = 0;
+    sock->size = 0;
+    sock->discarding = 0;
+}
+
+/* put the socket in the given error state and arrange for its event handler
+ * to be told about it once the current batch of events has been handled
+ */
+void set_socket_error(Socket *sock, int error) {
+    sock->error = error;
+    defer_event(&sock->ev, EV_ERROR);
+}
+
+/* arrange for newly-queued data to be written, unless there is now so much
+ * of it that the other end is clearly not keeping up, in which case put the
+ * socket in the error state; return 0 on success and -1 on error
+ */
+static int queued_data(Socket *sock) {
+    if(sock->maxqueue && sock->outq.bytes > sock->maxqueue) {
+        fprintf(stderr, "fd %d: output queue full (%zu bytes)\n", sock->fd,
+                sock->outq.bytes);
+        set_socket_error(sock, -1);
+        return -1;
+    }
+
+    defer_event(&sock->ev, EV_WRITE);
+
+    return 0;
+}
+
+/* queue the given string to be sent to the given socket, returning -1 if
+ * the socket is in an error state and 0 otherwise; if len >= 0 it should
+ * contain the length of str, otherwise strlen(str) will be used
+ * the data is actually written once the current batch of events has been
+ * handled, or when the socket next becomes writable
  */
 int send_socket_string(Socket *sock, const char *str, ssize_t len) {
-    ssize_t r;
+    if(sock->error)
+        return -1;
 
     if(len < 0)
         len = strlen(str);
 
-    printf("Sending: ##%s##\n", str);
+    /* a worker writes to the socket, so it needs a buffer of its own; the
+     * worker queues it
+     */
+    if(sock->peer) {
+        Buffer *buf = new_buffer(len);
+        memcpy(buf->data, str, len);
+        buf->len = len;
+        send_peer(sock->peer, buf);
+        free_buffer(buf);
+        return 0;
+    }
+
+    queue_append(&sock->outq, str, len);
 
-    /* keep trying while EINTR */
-    while((r = write(sock->fd, str, len)) < 0)
-        if(r != EINTR)
-            break;
+    return queued_data(sock);
+}
+
+/* queue a reference to buf to be sent to the given socket, returning -1 if
+ * the socket is in an error state and 0 otherwise; buf must not be modified
+ * afterwards, as it may be shared with other sockets until it is sent
+ */
+int send_socket_buffer(Socket *sock, Buffer *buf) {
+    if(sock->error)
+        return -1;
+
+    if(sock->peer) {
+        send_peer(sock->peer, buf);
+        return 0;
+    }
+
+    queue_buffer(&sock->outq, buf);
 
-    sock->error = r < 0 ? -1 : 0;
+    return queued_data(sock);
+}
+
+/* return room for len bytes at the end of the socket's output queue, so that
+ * a message can be written straight into it, or NULL if the socket is in an
+ * error state; nothing is sent until commit_socket is called with however
+ * many bytes were used, which must happen before anything else is sent
+ */
+char *reserve_socket(Socket *sock, size_t len) {
+    if(sock->error)
+        return NULL;
+
+    /* a worker's socket can't be written into, so give it a buffer */
+    if(sock->peer) {
+        sock->staged = new_buffer(len);
+        return sock->staged->data;
+    }
 
-    return sock->error;
+    return queue_reserve(&sock->outq, len);
 }
 
-/* read data from the file descriptor, appending it to the buffer, updating
- * *bufused to indicate how much is now used, and without going over the buflen
- * limit; return 0 on success and -1 on error
+/* send the first len bytes of what was written at data, which reserve_socket
+ * returned; return -1 if the socket is now in an error state and 0
+ * otherwise
+ */
+int commit_socket(Socket *sock, char *data, size_t len) {
+    if(sock->peer) {
+        sock->staged->len = len;
+        send_peer(sock->peer, sock->staged);
+        free_buffer(sock->staged);
+        sock->staged = NULL;
+        return 0;
+    }
+
+    queue_commit(&sock->outq, len);
+
+    return queued_data(sock);
+}
+
+/* write as much queued data as possible without blocking; return -1 on error
+ * (updating the socket error state) and 0 otherwise; a socket that belongs
+ * to a worker is written by the worker whenever it can be
+ */
+int flush_socket(Socket *sock) {
+    if(sock->peer || queue_flush(&sock->outq, sock->fd) >= 0)
+        return 0;
+
+    perror("writev");
+    set_socket_error(sock, -1);
+    return -1;
+}
+
+/* make sure there is room to read into the receive buffer, growing it if it
+ * is full; a line too long to fit even at socket_buffer_limit is thrown away,
+ * along with everything up to the next endline
+ */
+static void make_room(Socket *sock) {
+    if(sock->size - sock->bytes >= 2)
+        return;
+
+    if(sock->size < socket_buffer_limit) {
+        size_t size = sock->size ? sock->size * 2 : SOCKET_BUF_MIN;
+        if(size > socket_buffer_limit)
+            size = socket_buffer_limit;
+
+        sock->buf = realloc(sock->buf, size);
+        sock->size = size;
+    } else {
+        fprintf(stderr, "fd %d: discarding line longer than %zu bytes\n",
+                sock->fd, sock->size);
+        sock->bytes = 0;
+        sock->discarding = 1;
+    }
+}
+
+/* throw away the rest of a line that was too long, up to the endline */
+static void discard_line(Socket *sock) {
+    size_t n = 0;
+
+    while(n < sock->bytes && sock->buf[n] != '\r' && sock->buf[n] != '\n')
+        n++;
+
+    if(n == sock->bytes) {
+        sock->bytes = 0;
+    } else {
+        sock->bytes -= n;
+        memmove(sock->buf, sock->buf + n, sock->bytes + 1);
+        sock->discarding = 0;
+    }
+}
+
+/* read data from the file descriptor, appending it to the buffer (growing it
+ * if necessary), updating sock->bytes to indicate how much is now used;
+ * return 1 if data was read, 0 if there is nothing to read right now, and -1
+ * on error
  */
 int read_data(Socket *sock) {
     ssize_t r;
 
+    make_room(sock);
+
     /* keep reading until it is successful or the error is not EINTR */
-    while((r = read(sock->fd, sock->buf + sock->bytes, 1023 - sock->bytes)) < 0)
+    while((r = recv(sock->fd, sock->buf + sock->bytes,
+                    sock->size - sock->bytes - 1, MSG_DONTWAIT)) < 0)
         if(errno != EINTR)
             break;
 
+    /* the socket has been drained */
+    if(r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+
     /* return an error if there is an error */
     if(r <= 0) {
         if(r < 0)
             perror("read");
-        sock->error = -1;
+        set_socket_error(sock, -1);
         return -1;
     }
 
-    /* update *bufused and nul-terminate buf */
+    /* update sock->bytes and nul-terminate buf */
     sock->bytes += r;
     sock->buf[sock->bytes] = '\0';
 
-    printf("Read: %s", sock->buf);
+    if(sock->discarding)
+        discard_line(sock);
 
-    return 0;
+    return 1;
+}
+
+/* give back receive buffer space that isn't being used, so that idle sockets
+ * don't each hold on to a buffer that grew to hold one long line; this should
+ * be called once the socket has been read until there is nothing left
+ */
+void shrink_socket_buffer(Socket *sock) {
+    size_t size = SOCKET_BUF_MIN;
+
+    if(sock->bytes == 0) {
+        free(sock->buf);
+        sock->buf = NULL;
+        sock->size = 0;
+        return;
+    }
+
+    while(size <= sock->bytes)
+        size *= 2;
+
+    if(size < sock->size) {
+        sock->buf = realloc(sock->buf, size);
+        sock->size = size;
+    }
 }
@@ -6,15 +6,37 @@
 #ifndef SOCKET_H_INC
 #define SOCKET_H_INC
 
+/* receive buffers start this big and grow up to socket_buffer_limit */
+#define SOCKET_BUF_MIN 1024
+
+extern size_t socket_buffer_limit;
+
 typedef struct Socket {
     int fd;
     int error;
-    char buf[1024];
+    Event ev;
+    char *buf;
     size_t bytes;
+    size_t size;
+    int discarding;
+    Queue outq;
+    size_t maxqueue;
+    struct Peer *peer;
+    Buffer *staged;
 } Socket;
 
+void init_socket(Socket *sock);
 Socket *new_socket(void);
+void clear_socket(Socket *sock);
+void free_socket(Socket *sock);
+void close_socket(Socket *sock);
+void set_socket_error(Socket *sock, int error);
 int send_socket_string(Socket *sock, const char *str, ssize_t len);
+int send_socket_buffer(Socket *sock, Buffer *buf);
+char *reserve_socket(Socket *sock, size_t len);
+int commit_socket(Socket *sock, char *data, size_t len);
+int flush_socket(Socket *sock);
 int read_data(Socket *sock);
+void shrink_socket_buffer(Socket *sock);
 
 #endif
@@ -6,6 +6,12 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "str.h"
 
 /* return a copy of the first n characters in s */
@@ -40,3 +46,153 @@ char *strappend(char *s, char **end, size_t maxlen, const char *append) {
 
     return s;
 }
+
+/* return the CASEMAP_ constant for the CASEMAPPING value name, defaulting
+ * to rfc1459 (as RFC 1459 says) for anything unrecognised
+ */
+int parse_casemapping(const char *name) {
+    if(strcmp(name, "ascii") == 0)
+        return CASEMAP_ASCII;
+    if(strcmp(name, "strict-rfc1459") == 0)
+        return CASEMAP_STRICT_RFC1459;
+    return CASEMAP_RFC1459;
+}
+
+/* return the lower-case version of c under the given casemapping; rfc1459
+ * considers []\^ to be the upper-case versions of {}|~, and strict-rfc1459
+ * is the same except for ^ and ~
+ */
+int irc_tolower(int casemap, int c) {
+    if(c >= 'A' && c <= 'Z')
+        return c + ('a' - 'A');
+
+    if(casemap == CASEMAP_RFC1459 && c >= '[' && c <= '^')
+        return c + ('{' - '[');
+    if(casemap == CASEMAP_STRICT_RFC1459 && c >= '[' && c <= ']')
+        return c + ('{' - '[');
+
+    return c;
+}
+
+/* compare a and b, ignoring case under the given casemapping; return 0 if
+ * they are equal, and less than or greater than 0 like strcmp otherwise
+ */
+int irc_strcasecmp(int casemap, const char *a, const char *b) {
+    int ca, cb;
+
+    do {
+        ca = irc_tolower(casemap, (unsigned char)*a++);
+        cb = irc_tolower(casemap, (unsigned char)*b++);
+    } while(ca == cb && ca);
+
+    return ca - cb;
+}
+
+/* return a hash of s (FNV-1a) that is the same for any two strings that
+ * irc_strcasecmp considers equal
+ */
+unsigned irc_hash(int casemap, const char *s) {
+    unsigned h = 2166136261u;
+
+    while(*s) {
+        h ^= irc_tolower(casemap, (unsigned char)*s++);
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+/* add the line ending at endline to line[] (unless it is empty, i.e. the \n
+ * of a \r\n pair) and move *start past the endline character; return the
+ * new number of lines
+ */
+static inline int add_line(LineSpan *line, int n, size_t *start,
+        size_t endline) {
+    if(endline > *start) {
+        line[n].start = *start;
+        line[n].len = endline - *start;
+        n++;
+    }
+
+    *start = endline + 1;
+    return n;
+}
+
+/* add a line for every bit set in mask, which marks the endline characters
+ * in the 64-byte block starting at offset; return the new number of lines,
+ * stopping early if maxlines is reached
+ */
+static inline int add_lines(LineSpan *line, int n, int maxlines,
+        size_t *start, size_t offset, unsigned long long mask) {
+    while(mask && n < maxlines) {
+        n = add_line(line, n, start, offset + __builtin_ctzll(mask));
+        mask &= mask - 1;
+    }
+
+    return n;
+}
+
+#if defined(__AVX2__)
+/* return a mask of the \r and \n characters in the 32 bytes at p */
+static inline unsigned long long endline_mask32(const char *p) {
+    const __m256i cr = _mm256_set1_epi8('\r'), lf = _mm256_set1_epi8('\n');
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+
+    return (unsigned)_mm256_movemask_epi8(_mm256_or_si256(
+                _mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)));
+}
+
+/* return a mask of the \r and \n characters in the 64 bytes at p */
+static inline unsigned long long endline_mask(const char *p) {
+    return endline_mask32(p) | endline_mask32(p + 32) << 32;
+}
+#elif defined(__SSE2__)
+/* return a mask of the \r and \n characters in the 16 bytes at p */
+static inline unsigned long long endline_mask16(const char *p) {
+    const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+
+    return (unsigned)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr),
+                _mm_cmpeq_epi8(v, lf)));
+}
+
+/* return a mask of the \r and \n characters in the 64 bytes at p */
+static inline unsigned long long endline_mask(const char *p) {
+    return endline_mask16(p) | endline_mask16(p + 16) << 16
+        | endline_mask16(p + 32) << 32 | endline_mask16(p + 48) << 48;
+}
+#endif
+
+/* find the lines in the first len bytes of buf, which may contain nul
+ * bytes, storing the position of up to maxlines of them in line[]; a line
+ * is ended by any run of \r and \n characters, and empty lines are skipped
+ * *used is set to the number of bytes taken up by the lines that were found
+ * (including their endlines), which is where the next call should carry on
+ * from if maxlines were returned, or where any incomplete line begins
+ * return the number of lines found
+ */
+int split_lines(const char *buf, size_t len, LineSpan *line, int maxlines,
+        size_t *used) {
+    size_t start = 0, i = 0;
+    int n = 0;
+
+#if defined(__AVX2__) || defined(__SSE2__)
+    /* 64 bytes at a time with SIMD */
+    for(; i + 64 <= len && n < maxlines; i += 64) {
+        unsigned long long mask = endline_mask(buf + i);
+        if(mask)
+            n = add_lines(line, n, maxlines, &start, i, mask);
+    }
+#endif
+
+    /* whatever is left over (or everything, without SIMD) a byte at a time */
+    for(; i < len && n < maxlines; i++)
+        if(buf[i] == '\r' || buf[i] == '\n')
+            n = add_line(line, n, &start, i);
+
+    /* if we stopped because line[] is full, don't skip any endlines that
+     * belong to the last line; they will be skipped as empty lines next time
+     */
+    *used = start;
+    return n;
+}
@@ -6,7 +6,24 @@
 #ifndef STRING_H_INC
 #define STRING_H_INC
 
+/* a line found by split_lines, not including its endline characters */
+typedef struct LineSpan {
+    size_t start;
+    size_t len;
+} LineSpan;
+
+/* the ways of comparing names that servers advertise with CASEMAPPING */
+enum {
+    CASEMAP_RFC1459=0, CASEMAP_STRICT_RFC1459, CASEMAP_ASCII
+};
+
 char *strprefix(const char *s, size_t n);
 char *strappend(char *s, char **end, size_t maxlen, const char *append);
+int parse_casemapping(const char *name);
+int irc_tolower(int casemap, int c);
+int irc_strcasecmp(int casemap, const char *a, const char *b);
+unsigned irc_hash(int casemap, const char *s);
+int split_lines(const char *buf, size_t len, LineSpan *line, int maxlines,
+        size_t *used);
 
 #endif
@@ -0,0 +1,195 @@
+/* Hash tables for muxirc
+ *
+ * Open-addressing (linear probing) hash tables of items that are looked up
+ * by an IRC name (a channel or nick), ignoring case according to the
+ * server's casemapping.
+ *
+ * James Stanley 2012
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "str.h"
+#include "table.h"
+
+#define TABLE_MIN 16
+
+/* initialise an empty table whose items are named by key() */
+void init_table(Table *t, TableKey key, int casemap) {
+    memset(t, 0, sizeof(Table));
+    t->key = key;
+    t->casemap = casemap;
+}
+
+/* free the table's slots (but not the items in it) */
+void free_table(Table *t) {
+    free(t->slot);
+    t->slot = NULL;
+    t->size = 0;
+    t->count = 0;
+}
+
+/* return whether the item in the slot is called name, which it certainly is
+ * if its key is the same string (as it is for interned names)
+ */
+static int slot_is(const Table *t, const TableSlot *slot, const char *name,
+        unsigned hash) {
+    const char *key;
+
+    if(slot->hash != hash)
+        return 0;
+
+    key = t->key(slot->item);
+    return key == name || irc_strcasecmp(t->casemap, key, name) == 0;
+}
+
+/* return the index of the slot holding the item called name, or of the empty
+ * slot where it would go if it is not in the table; the table must not be
+ * full (which it never is, as it grows when it is half full)
+ */
+static size_t find_slot(const Table *t, const char *name, unsigned hash) {
+    size_t i = hash & (t->size - 1);
+
+    while(t->slot[i].item && !slot_is(t, t->slot + i, name, hash))
+        i = (i + 1) & (t->size - 1);
+
+    return i;
+}
+
+/* put item into the table without checking for duplicates or growing it */
+static void place(Table *t, void *item, unsigned hash) {
+    size_t i = hash & (t->size - 1);
+
+    while(t->slot[i].item)
+        i = (i + 1) & (t->size - 1);
+
+    t->slot[i].hash = hash;
+    t->slot[i].item = item;
+}
+
+/* change the number of slots to size, rehashing everything if rehash is
+ * non-zero (otherwise the stored hashes are reused)
+ */
+static void resize(Table *t, size_t size, int rehash) {
+    TableSlot *old = t->slot;
+    size_t oldsize = t->size, i;
+
+    t->slot = calloc(size, sizeof(TableSlot));
+    t->size = size;
+
+    for(i = 0; i < oldsize; i++) {
+        if(old[i].item) {
+            unsigned hash = old[i].hash;
+            if(rehash)
+                hash = irc_hash(t->casemap, t->key(old[i].item));
+            place(t, old[i].item, hash);
+        }
+    }
+
+    free(old);
+}
+
+/* return the item called name, or NULL if there is none */
+void *table_lookup(const Table *t, const char *name) {
+    if(!t->count)
+        return NULL;
+
+    return table_lookup_hash(t, name, irc_hash(t->casemap, name));
+}
+
+/* return the item called name, whose hash under the table's casemapping is
+ * already known, or NULL if there is none
+ */
+void *table_lookup_hash(const Table *t, const char *name, unsigned hash) {
+    if(!t->count)
+        return NULL;
+
+    return t->slot[find_slot(t, name, hash)].item;
+}
+
+/* add item to the table; there must not already be an item with its name */
+void table_insert(Table *t, void *item) {
+    table_insert_hash(t, item, irc_hash(t->casemap, t->key(item)));
+}
+
+/* add item, whose name has the given hash, to the table; there must not
+ * already be an item with its name
+ */
+void table_insert_hash(Table *t, void *item, unsigned hash) {
+    if((t->count + 1) * 2 > t->size)
+        resize(t, t->size ? t->size * 2 : TABLE_MIN, 0);
+
+    place(t, item, hash);
+    t->count++;
+}
+
+/* remove and return the item called name, or return NULL if there is none */
+void *table_remove(Table *t, const char *name) {
+    if(!t->count)
+        return NULL;
+
+    return table_remove_hash(t, name, irc_hash(t->casemap, name));
+}
+
+/* remove and return the item called name, whose hash is already known, or
+ * return NULL if there is none
+ */
+void *table_remove_hash(Table *t, const char *name, unsigned hash) {
+    size_t i, j;
+    void *item;
+
+    if(!t->count)
+        return NULL;
+
+    i = find_slot(t, name, hash);
+    if(!(item = t->slot[i].item))
+        return NULL;
+
+    t->slot[i].item = NULL;
+    t->count--;
+
+    /* move back any following items that would no longer be found because
+     * of the gap, so that no tombstones are needed
+     */
+    for(j = (i + 1) & (t->size - 1); t->slot[j].item;
+            j = (j + 1) & (t->size - 1)) {
+        size_t home = t->slot[j].hash & (t->size - 1);
+
+        /* move it into the gap unless its home slot lies (cyclically)
+         * between the gap and where it is now
+         */
+        if((j > i && (home <= i || home > j))
+                || (j < i && (home <= i && home > j))) {
+            t->slot[i] = t->slot[j];
+            t->slot[j].item = NULL;
+            i = j;
+        }
+    }
+
+    return item;
+}
+
+/* change the casemapping used to compare names, rehashing everything */
+void table_set_casemap(Table *t, int casemap) {
+    if(casemap == t->casemap)
+        return;
+
+    t->casemap = casemap;
+    if(t->size)
+        resize(t, t->size, 1);
+}
+
+/* return the next item in the table, starting from slot *i and updating *i
+ * to continue from there next time, or NULL if there are no more; start with
+ * *i = 0, and don't insert anything while iterating
+ */
+void *table_next(const Table *t, size_t *i) {
+    while(*i < t->size) {
+        void *item = t->slot[(*i)++].item;
+        if(item)
+            return item;
+    }
+
+    return NULL;
+}
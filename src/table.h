@@ -0,0 +1,36 @@
+/* Hash tables for muxirc
+ *
+ * James Stanley 2012
+ */
+
+#ifndef TABLE_H_INC
+#define TABLE_H_INC
+
+/* return the name an item in a table is looked up by */
+typedef const char *(*TableKey)(const void *);
+
+typedef struct TableSlot {
+    unsigned hash;
+    void *item;
+} TableSlot;
+
+typedef struct Table {
+    TableSlot *slot;
+    size_t size;
+    size_t count;
+    int casemap;
+    TableKey key;
+} Table;
+
+void init_table(Table *t, TableKey key, int casemap);
+void free_table(Table *t);
+void *table_lookup(const Table *t, const char *name);
+void *table_lookup_hash(const Table *t, const char *name, unsigned hash);
+void table_insert(Table *t, void *item);
+void table_insert_hash(Table *t, void *item, unsigned hash);
+void *table_remove(Table *t, const char *name);
+void *table_remove_hash(Table *t, const char *name, unsigned hash);
+void table_set_casemap(Table *t, int casemap);
+void *table_next(const Table *t, size_t *i);
+
+#endif
@@ -0,0 +1,320 @@
+/* Worker handling for muxirc
+ *
+ * A shard can hand its clients' sockets to worker threads, which do the
+ * reading, parsing and writing for them. The shard sends each worker the
+ * buffers to write through one ring and gets the clients' messages back
+ * through another; a client only ever belongs to one worker, so everything
+ * sent to it stays in order.
+ *
+ * James Stanley 2012
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <sys/eventfd.h>
+
+#include "event.h"
+#include "buffer.h"
+#include "socket.h"
+#include "worker.h"
+#include "message.h"
+
+/* wake the consumer of the ring up; this is deferred until the end of the
+ * batch of events, so that however many jobs were pushed it only costs one
+ * write
+ */
+static void kick_ring(void *data, int events) {
+    Ring *r = data;
+    uint64_t one = 1;
+
+    if(write(r->fd, &one, sizeof(one)) == -1)
+        perror("write");
+}
+
+/* set up an empty ring; return 0 on success and -1 on error */
+static int init_ring(Ring *r) {
+    memset(r, 0, sizeof(Ring));
+
+    if((r->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        perror("eventfd");
+        return -1;
+    }
+
+    r->head = r->tail = calloc(1, sizeof(RingBlock));
+    r->ev.fd = -1;
+
+    return 0;
+}
+
+/* add a job to the ring; this must only be called by the producer's thread
+ * and the ring must already be set up to kick from it
+ */
+static void push_job(Ring *r, const Job *j) {
+    RingBlock *b = r->tail;
+
+    if(b->n == RING_BLOCK) {
+        RingBlock *next = calloc(1, sizeof(RingBlock));
+        __atomic_store_n(&b->next, next, __ATOMIC_RELEASE);
+        r->tail = b = next;
+    }
+
+    /* the job has to be there before the consumer can see the count */
+    b->job[b->n] = *j;
+    __atomic_store_n(&b->n, b->n + 1, __ATOMIC_RELEASE);
+
+    defer_event(&r->kick, EV_WRITE);
+}
+
+/* take the next job off the ring; this must only be called by the
+ * consumer's thread; return 1 if there was a job and 0 if there wasn't
+ */
+static int pop_job(Ring *r, Job *j) {
+    RingBlock *b = r->head;
+
+    if(r->pos == RING_BLOCK) {
+        RingBlock *next = __atomic_load_n(&b->next, __ATOMIC_ACQUIRE);
+        if(!next)
+            return 0;
+
+        free(b);
+        r->head = b = next;
+        r->pos = 0;
+    }
+
+    if(r->pos == __atomic_load_n(&b->n, __ATOMIC_ACQUIRE))
+        return 0;
+
+    *j = b->job[r->pos++];
+    return 1;
+}
+
+/* clear the ring's eventfd; this must happen before the ring is emptied, so
+ * that a job pushed after that always wakes the consumer again
+ */
+static void drain_ring(Ring *r) {
+    uint64_t n;
+
+    if(read(r->fd, &n, sizeof(n)) == -1 && errno != EAGAIN)
+        perror("read");
+}
+
+/* pass a message from a client back to the shard */
+static int peer_message(Peer *p, const Message *m) {
+    Job j;
+
+    memset(&j, 0, sizeof(Job));
+    j.type = JOB_MESSAGE;
+    j.client = p->client;
+    j.m = copy_message(m);
+    push_job(&(p->worker->out), &j);
+
+    return 0;
+}
+
+/* the shard is finished with the client: send whatever is still queued,
+ * close the connection, and give the client back to be freed
+ */
+static void finish_peer(Peer *p) {
+    Job j;
+
+    if(!p->failed)
+        flush_socket(&p->sock);
+    close_socket(&p->sock);
+
+    memset(&j, 0, sizeof(Job));
+    j.type = JOB_CLOSED;
+    j.client = p->client;
+    push_job(&(p->worker->out), &j);
+
+    free(p);
+}
+
+/* handle an event on a client socket; as with clients handled by the shard
+ * itself, errors (and closes) are only delivered as deferred events, so it
+ * is safe to free the peer here
+ */
+static void handle_peer_event(void *data, int events) {
+    Peer *p = data;
+
+    if(events & EV_ERROR) {
+        Job j;
+
+        if(p->closing) {
+            finish_peer(p);
+            return;
+        }
+
+        /* tell the shard, which will close the client in its own time */
+        if(!p->failed) {
+            p->failed = 1;
+            memset(&j, 0, sizeof(Job));
+            j.type = JOB_ERROR;
+            j.client = p->client;
+            push_job(&(p->worker->out), &j);
+        }
+        return;
+    }
+
+    if(events & EV_READ) {
+        while(!p->sock.error && read_data(&p->sock) > 0)
+            handle_messages(&p->sock, (GenericMessageHandler)peer_message, p);
+
+        shrink_socket_buffer(&p->sock);
+    }
+    if(events & EV_WRITE)
+        flush_socket(&p->sock);
+}
+
+/* do the jobs the shard has given the worker */
+static void handle_worker_jobs(void *data, int events) {
+    Worker *w = data;
+    Job j;
+
+    drain_ring(&(w->in));
+
+    while(pop_job(&(w->in), &j)) {
+        Peer *p = j.peer;
+
+        switch(j.type) {
+        case JOB_ADD:
+            if(add_event(&(p->sock.ev), p->sock.fd, EV_READ | EV_WRITE,
+                        handle_peer_event, p) != 0)
+                set_socket_error(&p->sock, -1);
+            break;
+        case JOB_SEND:
+            send_socket_buffer(&p->sock, j.buf);
+            free_buffer(j.buf);
+            break;
+        case JOB_CLOSE:
+            p->closing = 1;
+            defer_event(&(p->sock.ev), EV_ERROR);
+            break;
+        }
+    }
+}
+
+/* hand what the workers have done on behalf of the clients to the shard */
+static void handle_worker_results(void *data, int events) {
+    Worker *w = data;
+    Job j;
+
+    drain_ring(&(w->out));
+
+    while(pop_job(&(w->out), &j))
+        w->handle(&j);
+}
+
+/* run the event loop for the worker's clients */
+static void *run_worker(void *data) {
+    Worker *w = data;
+
+    if(init_events() != 0)
+        exit(1);
+
+    init_event(&(w->out.kick), kick_ring, &(w->out));
+    if(add_event(&(w->in.ev), w->in.fd, EV_READ, handle_worker_jobs, w) != 0)
+        exit(1);
+
+    while(1) {
+        if(wait_events(-1) == -1) {
+            perror("epoll_wait");
+            exit(1);
+        }
+    }
+
+    return NULL;
+}
+
+/* start n workers for the calling thread's clients; handle is called from
+ * the calling thread's event loop with what they send back; return 0 on
+ * success and -1 on error
+ */
+int start_workers(Workers *w, int n, JobHandler handle) {
+    pthread_attr_t attr;
+    pthread_t thread;
+    int i, err;
+
+    w->worker = calloc(n, sizeof(Worker));
+    w->n = n;
+    w->next = 0;
+
+    /* nothing waits for the workers; they run until the process exits */
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    for(i = 0; i < n; i++) {
+        Worker *wk = w->worker + i;
+
+        wk->handle = handle;
+        if(init_ring(&(wk->in)) != 0 || init_ring(&(wk->out)) != 0)
+            break;
+
+        init_event(&(wk->in.kick), kick_ring, &(wk->in));
+        if(add_event(&(wk->out.ev), wk->out.fd, EV_READ,
+                    handle_worker_results, wk) != 0)
+            break;
+
+        if((err = pthread_create(&thread, &attr, run_worker, wk))) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            break;
+        }
+    }
+
+    pthread_attr_destroy(&attr);
+
+    return i == n ? 0 : -1;
+}
+
+/* give the connection on sock to the next worker in turn, and return the
+ * peer that stands for it there; from then on the worker owns sock->fd, and
+ * client is what the worker's results are for
+ */
+Peer *add_peer(Workers *w, Socket *sock, void *client) {
+    Peer *p = malloc(sizeof(Peer));
+    Job j;
+
+    memset(p, 0, sizeof(Peer));
+    init_socket(&p->sock);
+    p->sock.fd = sock->fd;
+    p->sock.maxqueue = sock->maxqueue;
+    p->client = client;
+    p->worker = w->worker + w->next;
+    w->next = (w->next + 1) % w->n;
+
+    memset(&j, 0, sizeof(Job));
+    j.type = JOB_ADD;
+    j.peer = p;
+    push_job(&(p->worker->in), &j);
+
+    return p;
+}
+
+/* queue a reference to buf to be written to the peer by its worker */
+void send_peer(Peer *p, Buffer *buf) {
+    Job j;
+
+    memset(&j, 0, sizeof(Job));
+    j.type = JOB_SEND;
+    j.peer = p;
+    j.buf = ref_buffer(buf);
+    push_job(&(p->worker->in), &j);
+}
+
+/* ask the peer's worker to close it once everything queued has been sent;
+ * the peer must not be used again, and its client is handed back with
+ * JOB_CLOSED once it is gone
+ */
+void close_peer(Peer *p) {
+    Job j;
+
+    memset(&j, 0, sizeof(Job));
+    j.type = JOB_CLOSE;
+    j.peer = p;
+    push_job(&(p->worker->in), &j);
+}
@@ -0,0 +1,82 @@
+/* Worker handling for muxirc
+ *
+ * James Stanley 2012
+ */
+
+#ifndef WORKER_H_INC
+#define WORKER_H_INC
+
+/* jobs are passed between threads in blocks of this many */
+#define RING_BLOCK 64
+
+enum {
+    /* from the shard to a worker */
+    JOB_ADD, JOB_SEND, JOB_CLOSE,
+    /* from a worker back to the shard */
+    JOB_MESSAGE, JOB_ERROR, JOB_CLOSED
+};
+
+/* something for one thread to do on behalf of another; client is the
+ * shard's client, which a worker only ever hands back
+ */
+typedef struct Job {
+    int type;
+    void *client;
+    struct Peer *peer;
+    Buffer *buf;
+    struct Message *m;
+} Job;
+
+typedef void(*JobHandler)(Job *);
+
+typedef struct RingBlock {
+    Job job[RING_BLOCK];
+    int n;
+    struct RingBlock *next;
+} RingBlock;
+
+/* jobs from one thread to one other thread; each end is only touched by its
+ * own thread, so no locks are needed, and the two ends are kept a cache line
+ * apart so that they don't fight over one
+ */
+typedef struct Ring {
+    int fd;
+    /* the producer's end */
+    RingBlock *tail;
+    Event kick;
+    char pad[64];
+    /* the consumer's end */
+    RingBlock *head;
+    int pos;
+    Event ev;
+} Ring;
+
+/* a thread that reads from and writes to some of the clients */
+typedef struct Worker {
+    Ring in;
+    Ring out;
+    JobHandler handle;
+} Worker;
+
+/* a client connection that belongs to a worker */
+typedef struct Peer {
+    Socket sock;
+    void *client;
+    Worker *worker;
+    int failed;
+    int closing;
+} Peer;
+
+/* the workers that a shard's clients are shared between */
+typedef struct Workers {
+    Worker *worker;
+    int n;
+    int next;
+} Workers;
+
+int start_workers(Workers *w, int n, JobHandler handle);
+Peer *add_peer(Workers *w, struct Socket *sock, void *client);
+void send_peer(Peer *p, Buffer *buf);
+void close_peer(Peer *p);
+
+#endif